@@ -1,33 +1,99 @@
 #ifndef ALIGNMENT_H_
 #define ALIGNMENT_H_
 
+#include<cstdio>
+#include<cstring>
+#include<cassert>
+#include<vector>
+#include<stdint.h>
+
 #include "utils.h"
+#include "my_assert.h"
+
+// Column-wise storage of all aligned records in input order.
+// Chromosome ids and positions cost 4 bytes each and can be released once the chromosomes are discretized.
+// Direction, multi-read flag and read boundary are packed into 4 bits per alignment.
+// Fractions are not stored here: unique alignments always have 1.0 and multi-read fractions live in ChromTable.
+class AlignmentTable {
+ public:
+  AlignmentTable() { clear(); }
+
+  void clear();
+  void reserve(HIT_INT_TYPE);
+
+  // isFirst, if this is the first alignment of a read
+  void push_back(CHR_ID_TYPE, CHR_LEN_TYPE, char, bool);
+
+  HIT_INT_TYPE size() const { return nAmts; }
+
+  CHR_ID_TYPE getCid(HIT_INT_TYPE i) const { return cids[i]; }
+  CHR_LEN_TYPE getPos(HIT_INT_TYPE i) const { return poss[i]; }
+  char getDir(HIT_INT_TYPE i) const { return getFlag(i, DIR_MINUS) ? '-' : '+'; }
 
-struct Alignment {
-  CHR_ID_TYPE cid;
-  CHR_LEN_TYPE pos;
-  double frac;
+  bool isFirst(HIT_INT_TYPE i) const { return getFlag(i, FIRST); }
+  bool isMulti(HIT_INT_TYPE i) const { return getFlag(i, MULTI); }
+  void setMulti(HIT_INT_TYPE i) { flags[i >> 1] |= MULTI << ((i & 1) << 2); }
 
-  char dir; // + or -
-  bool isMulti; 
+  // cids and poss are only needed for discretization
+  void releaseCoordinates();
 
-  Alignment() { cid = -1; pos = -1; frac = 0.0; dir = 0; isMulti = false; }
+  // the columns as written by writeRaw take rawSize(nAmts) bytes, readRaw copies them back from memory
+  static size_t rawSize(HIT_INT_TYPE nAmts) { return nAmts * (sizeof(CHR_ID_TYPE) + sizeof(CHR_LEN_TYPE)) + (nAmts + 1) / 2; }
+  void writeRaw(FILE*) const;
+  void readRaw(HIT_INT_TYPE, const char*);
 
-  Alignment(CHR_ID_TYPE cid, CHR_LEN_TYPE pos, char dir, double frac = 0.0, bool isMulti = false) {
-    this->cid = cid;
-    this->pos = pos;
-    this->dir = dir;
-    this->frac = frac;
-    this->isMulti = isMulti;
-  }
+ private:
+  enum { DIR_MINUS = 1, MULTI = 2, FIRST = 4 };
 
-  bool operator< (const Alignment& o) const {
-    return cid < o.cid || (cid == o.cid && pos < o.pos);
-  }
+  HIT_INT_TYPE nAmts;
+  std::vector<CHR_ID_TYPE> cids;
+  std::vector<CHR_LEN_TYPE> poss;
+  std::vector<uint8_t> flags; // two alignments per byte
 
-  bool operator== (const Alignment& o) const {
-    return cid == o.cid && pos == o.pos;
-  }
+  bool getFlag(HIT_INT_TYPE i, int flag) const { return (flags[i >> 1] >> ((i & 1) << 2)) & flag; }
 };
 
+void AlignmentTable::clear() {
+  nAmts = 0;
+  cids.clear();
+  poss.clear();
+  flags.clear();
+}
+
+void AlignmentTable::reserve(HIT_INT_TYPE size) {
+  cids.reserve(size);
+  poss.reserve(size);
+  flags.reserve((size + 1) / 2);
+}
+
+void AlignmentTable::push_back(CHR_ID_TYPE cid, CHR_LEN_TYPE pos, char dir, bool isFirst) {
+  assert(dir == '+' || dir == '-');
+  cids.push_back(cid);
+  poss.push_back(pos);
+  if ((nAmts & 1) == 0) flags.push_back(0);
+  flags.back() |= ((dir == '-' ? DIR_MINUS : 0) | (isFirst ? FIRST : 0)) << ((nAmts & 1) << 2);
+  ++nAmts;
+}
+
+void AlignmentTable::releaseCoordinates() {
+  std::vector<CHR_ID_TYPE>().swap(cids);
+  std::vector<CHR_LEN_TYPE>().swap(poss);
+}
+
+void AlignmentTable::writeRaw(FILE* fo) const {
+  assert(cids.size() == nAmts && poss.size() == nAmts);
+  if (nAmts == 0) return;
+  general_assert(fwrite(&cids[0], sizeof(CHR_ID_TYPE), nAmts, fo) == nAmts && fwrite(&poss[0], sizeof(CHR_LEN_TYPE), nAmts, fo) == nAmts &&
+		 fwrite(&flags[0], 1, flags.size(), fo) == flags.size(), "Fail to write raw alignments!");
+}
+
+void AlignmentTable::readRaw(HIT_INT_TYPE nAmts, const char* p) {
+  this->nAmts = nAmts;
+  cids.resize(nAmts); poss.resize(nAmts); flags.resize((nAmts + 1) / 2);
+  if (nAmts == 0) return;
+  memcpy(&cids[0], p, nAmts * sizeof(CHR_ID_TYPE)); p += nAmts * sizeof(CHR_ID_TYPE);
+  memcpy(&poss[0], p, nAmts * sizeof(CHR_LEN_TYPE)); p += nAmts * sizeof(CHR_LEN_TYPE);
+  memcpy(&flags[0], p, flags.size());
+}
+
 #endif
@@ -0,0 +1,183 @@
+#ifndef ALIGNMENTCACHE_H_
+#define ALIGNMENTCACHE_H_
+
+#include<cstdio>
+#include<cstring>
+#include<cassert>
+#include<string>
+#include<vector>
+#include<fcntl.h>
+#include<unistd.h>
+#include<stdint.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/types.h>
+
+#include "utils.h"
+#include "my_assert.h"
+
+#include "BamAlignment.h"
+
+// The aligned records of an input file reduced to what csem needs from them, stored column by column so that the
+// file can be memory-mapped and scanned without parsing. Positions are kept raw; midpoints for any fragment
+// length are derived on the fly with BamAlignment::midPos.
+//
+// Layout: Header, then cids, poss, isizes and lens as 4-byte columns and flags as a byte column, nAmts entries each.
+class AlignmentCache {
+ public:
+  AlignmentCache() : fd(-1), map(NULL), mapSize(0) { memset(&header, 0, sizeof(header)); }
+  ~AlignmentCache() { close(); }
+
+  // collect records while the input is read, then write them with write
+  void add(const BamAlignment&, bool);
+  void write(const char*, READ_INT_TYPE, CHR_ID_TYPE, HIT_INT_TYPE, const char*);
+
+  // map a cache, inpF is the input it must have been built from
+  void open(const char*, CHR_ID_TYPE, const char*);
+
+  // size of HIT_INT_TYPE in the build that wrote a cache, 0 if the file is not a cache
+  static int getIndexSize(const char*);
+  void close();
+
+  READ_INT_TYPE getNumReads() const { return header.n; }
+  HIT_INT_TYPE size() const { return header.nAmts; }
+  HIT_INT_TYPE getNumRecords() const { return header.nRecords; }
+
+  CHR_ID_TYPE getCid(HIT_INT_TYPE i) const { return cids[i]; }
+  CHR_LEN_TYPE getPos(HIT_INT_TYPE i) const { return poss[i]; }
+  char getDir(HIT_INT_TYPE i) const { return (flags[i] & DIR_MINUS) ? '-' : '+'; }
+  bool isFirst(HIT_INT_TYPE i) const { return flags[i] & FIRST; }
+  CHR_LEN_TYPE getMidPos(HIT_INT_TYPE i, int fragment_length) const { return BamAlignment::midPos(poss[i], isizes[i], lens[i], getDir(i), fragment_length); }
+
+ private:
+  enum { DIR_MINUS = 1, FIRST = 2 };
+
+  struct Header {
+    char magic[8];
+    int32_t typeSizes[4]; // sizes of HIT_INT_TYPE, READ_INT_TYPE, CHR_ID_TYPE and CHR_LEN_TYPE
+    CHR_ID_TYPE m;
+    READ_INT_TYPE n;
+    HIT_INT_TYPE nAmts, nRecords; // nRecords counts unaligned records too
+    int64_t inputSize; // size of the input file, to catch a cache used with the wrong input
+  };
+
+  static const char MAGIC[8];
+
+  std::string fileName;
+  Header header;
+
+  // columns being collected by add
+  std::vector<CHR_ID_TYPE> cidVec;
+  std::vector<CHR_LEN_TYPE> posVec;
+  std::vector<int32_t> isizeVec, lenVec;
+  std::vector<uint8_t> flagVec;
+
+  // columns of a mapped cache
+  int fd;
+  const char *map;
+  size_t mapSize;
+  const CHR_ID_TYPE *cids;
+  const CHR_LEN_TYPE *poss;
+  const int32_t *isizes, *lens;
+  const uint8_t *flags;
+
+  static int64_t fileSize(const char*);
+
+  template<class T> void writeColumn(FILE* fo, const std::vector<T>& column) {
+    if (column.empty()) return;
+    general_assert(fwrite(&column[0], sizeof(T), column.size(), fo) == column.size(), "Fail to write to " + fileName + "!");
+  }
+};
+
+const char AlignmentCache::MAGIC[8] = {'C', 'S', 'E', 'M', 'C', 'A', 'C', '1'};
+
+void AlignmentCache::add(const BamAlignment& b, bool isFirst) {
+  cidVec.push_back(b.getCid());
+  posVec.push_back(b.getPos());
+  isizeVec.push_back(b.isPaired() ? b.getISize() : 0);
+  lenVec.push_back(b.getSeqLength());
+  flagVec.push_back((b.getDir() == '-' ? DIR_MINUS : 0) | (isFirst ? FIRST : 0));
+}
+
+void AlignmentCache::write(const char* cacheF, READ_INT_TYPE n, CHR_ID_TYPE m, HIT_INT_TYPE nRecords, const char* inpF) {
+  FILE *fo;
+
+  fileName = cacheF;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.typeSizes[0] = sizeof(HIT_INT_TYPE); header.typeSizes[1] = sizeof(READ_INT_TYPE);
+  header.typeSizes[2] = sizeof(CHR_ID_TYPE); header.typeSizes[3] = sizeof(CHR_LEN_TYPE);
+  header.m = m; header.n = n;
+  header.nAmts = cidVec.size(); header.nRecords = nRecords;
+  header.inputSize = fileSize(inpF);
+
+  fo = fopen(cacheF, "wb");
+  general_assert(fo != NULL, "Cannot write to " + fileName + "!");
+  general_assert(fwrite(&header, sizeof(header), 1, fo) == 1, "Fail to write to " + fileName + "!");
+  writeColumn(fo, cidVec); writeColumn(fo, posVec);
+  writeColumn(fo, isizeVec); writeColumn(fo, lenVec);
+  writeColumn(fo, flagVec);
+  general_assert(fclose(fo) == 0, "Fail to write to " + fileName + "!");
+
+  std::vector<CHR_ID_TYPE>().swap(cidVec);
+  std::vector<CHR_LEN_TYPE>().swap(posVec);
+  std::vector<int32_t>().swap(isizeVec);
+  std::vector<int32_t>().swap(lenVec);
+  std::vector<uint8_t>().swap(flagVec);
+}
+
+void AlignmentCache::open(const char* cacheF, CHR_ID_TYPE m, const char* inpF) {
+  struct stat st;
+  const char *p;
+
+  close();
+  fileName = cacheF;
+
+  fd = ::open(cacheF, O_RDONLY);
+  general_assert(fd >= 0, "Cannot open " + fileName + "!");
+  general_assert(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header), fileName + " is not an alignment cache!");
+  mapSize = st.st_size;
+  map = (const char*)mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  general_assert(map != MAP_FAILED, "Cannot map " + fileName + "!");
+  madvise((void*)map, mapSize, MADV_SEQUENTIAL);
+
+  memcpy(&header, map, sizeof(header));
+  general_assert(!memcmp(header.magic, MAGIC, sizeof(MAGIC)), fileName + " is not an alignment cache!");
+  general_assert(header.typeSizes[0] == sizeof(HIT_INT_TYPE) && header.typeSizes[1] == sizeof(READ_INT_TYPE) &&
+		 header.typeSizes[2] == sizeof(CHR_ID_TYPE) && header.typeSizes[3] == sizeof(CHR_LEN_TYPE), fileName + " was written by a build with different integer types!");
+  general_assert(mapSize == sizeof(Header) + (size_t)header.nAmts * (sizeof(CHR_ID_TYPE) + sizeof(CHR_LEN_TYPE) + 2 * sizeof(int32_t) + 1), fileName + " is truncated!");
+  general_assert(header.m == m && header.inputSize == fileSize(inpF), fileName + " was not built from " + cstrtos(inpF) + "!");
+
+  p = map + sizeof(Header);
+  cids = (const CHR_ID_TYPE*)p; p += header.nAmts * sizeof(CHR_ID_TYPE);
+  poss = (const CHR_LEN_TYPE*)p; p += header.nAmts * sizeof(CHR_LEN_TYPE);
+  isizes = (const int32_t*)p; p += header.nAmts * sizeof(int32_t);
+  lens = (const int32_t*)p; p += header.nAmts * sizeof(int32_t);
+  flags = (const uint8_t*)p;
+}
+
+void AlignmentCache::close() {
+  if (map != NULL) { munmap((void*)map, mapSize); map = NULL; mapSize = 0; }
+  if (fd >= 0) { ::close(fd); fd = -1; }
+}
+
+// magic and typeSizes lead the header in every build
+int AlignmentCache::getIndexSize(const char* cacheF) {
+  char magic[8];
+  int32_t hitSize;
+  FILE *fi = fopen(cacheF, "rb");
+
+  if (fi == NULL) return 0;
+  if (fread(magic, 1, 8, fi) != 8 || memcmp(magic, MAGIC, 8) || fread(&hitSize, 4, 1, fi) != 1) hitSize = 0;
+  fclose(fi);
+
+  return hitSize;
+}
+
+int64_t AlignmentCache::fileSize(const char* fileName) {
+  struct stat st;
+  general_assert(stat(fileName, &st) == 0, "Cannot access " + cstrtos(fileName) + "!");
+  return st.st_size;
+}
+
+#endif
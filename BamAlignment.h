@@ -13,6 +13,8 @@
 #include "utils.h"
 #include "my_assert.h"
 
+#include "sam_csem_aux.h"
+
 class BamAlignment {
  public:
   BamAlignment();
@@ -21,6 +23,10 @@ class BamAlignment {
 
   bool read(samfile_t *);
   bool write(samfile_t *);
+
+  // uncompressed in-memory records, no parsing is needed to read them back
+  void writeRaw(FILE *);
+  bool readRaw(FILE *);
   
   void writeToBED(FILE*, const bam_header_t*);
   void writeToTagAlign(FILE*, const bam_header_t*);
@@ -35,6 +41,11 @@ class BamAlignment {
   }
 
   std::string getName() const { return std::string((char*)bam1_qname(b)); }
+
+  // compare read names in place, without building strings
+  bool hasSameName(const BamAlignment& o) const {
+    return b->core.l_qname == o.b->core.l_qname && !memcmp(bam1_qname(b), bam1_qname(o.b), b->core.l_qname);
+  }
   
   CHR_ID_TYPE getCid() const { return b->core.tid; }
 
@@ -47,8 +58,13 @@ class BamAlignment {
 
   // if length = 2k, midpoint is k - 1
   CHR_LEN_TYPE getMidPos(int fragment_length) const {
-    if (is_paired && getISize() > 0) return getPos() + (getISize() - 1) / 2;
-    return (getDir() == '+' ? getPos() + (fragment_length - 1) / 2 : getPos() + getSeqLength() - fragment_length / 2 - 1);
+    return midPos(getPos(), is_paired ? getISize() : 0, getSeqLength(), getDir(), fragment_length);
+  }
+
+  // midpoint from the fields it depends on, isize is only used if positive; see AlignmentCache.h
+  static CHR_LEN_TYPE midPos(CHR_LEN_TYPE pos, int isize, int seqLength, char dir, int fragment_length) {
+    if (isize > 0) return pos + (isize - 1) / 2;
+    return (dir == '+' ? pos + (fragment_length - 1) / 2 : pos + seqLength - fragment_length / 2 - 1);
   }
 
   char getDir() const { 
@@ -117,6 +133,9 @@ class BamAlignment {
   bool is_paired;
   bam1_t *b, *b2;
 
+  void writeRaw(FILE*, const bam1_t*);
+  void readRaw(FILE*, bam1_t*);
+
   uint8_t getMAPQ(float val) {
     float err = 1.0 - val;
     if (err <= 1e-10) return 100;
@@ -224,6 +243,34 @@ bool BamAlignment::write(samfile_t *out) {
   return true;
 }
 
+void BamAlignment::writeRaw(FILE *fo) {
+  char paired = is_paired;
+  general_assert(fwrite(&paired, 1, 1, fo) == 1, "Fail to write raw alignments!");
+  writeRaw(fo, b);
+  if (is_paired) writeRaw(fo, b2);
+}
+
+bool BamAlignment::readRaw(FILE *fi) {
+  char paired;
+  if (fread(&paired, 1, 1, fi) != 1) return false;
+  is_paired = paired;
+  readRaw(fi, b);
+  if (is_paired) readRaw(fi, b2);
+  return true;
+}
+
+void BamAlignment::writeRaw(FILE *fo, const bam1_t *b) {
+  general_assert(fwrite(&b->core, sizeof(bam1_core_t), 1, fo) == 1 && fwrite(&b->l_aux, sizeof(int), 1, fo) == 1 &&
+		 fwrite(&b->data_len, sizeof(int), 1, fo) == 1 && fwrite(b->data, 1, b->data_len, fo) == (size_t)b->data_len, "Fail to write raw alignments!");
+}
+
+void BamAlignment::readRaw(FILE *fi, bam1_t *b) {
+  general_assert(fread(&b->core, sizeof(bam1_core_t), 1, fi) == 1 && fread(&b->l_aux, sizeof(int), 1, fi) == 1 &&
+		 fread(&b->data_len, sizeof(int), 1, fi) == 1, "Fail to read raw alignments!");
+  expand_data_size(b);
+  general_assert(fread(b->data, 1, b->data_len, fi) == (size_t)b->data_len, "Fail to read raw alignments!");
+}
+
 void BamAlignment::writeToBED(FILE *fo, const bam_header_t *header) {
   if (b->core.flag & 0x0004) return;
   fprintf(fo, "%s\t%d\t%d\t%s\t%.2f\t%c\n", header->target_name[b->core.tid], b->core.pos, b->core.pos + b->core.l_qseq, (char*)bam1_qname(b), getFrac() * 1000.0, ((b->core.flag & 0x0010) == 0 ? '+' : '-'));
@@ -23,7 +23,8 @@
 
 class BamWriter {
  public:
-  BamWriter(const char*, const bam_header_t*) ;
+  // nThreads > 1 compresses the output blocks in parallel
+  BamWriter(const char*, const bam_header_t*, int = 1);
   ~BamWriter();
   
   void write(BamAlignment& b) { b.write(bam_out); }
@@ -32,7 +33,7 @@ class BamWriter {
   samfile_t *bam_out;
 };
 
-BamWriter::BamWriter(const char* outF, const bam_header_t* header) {
+BamWriter::BamWriter(const char* outF, const bam_header_t* header, int nThreads) {
   bam_header_t *out_header = bam_header_dwt(header);
   
   std::ostringstream strout;
@@ -42,6 +43,8 @@ BamWriter::BamWriter(const char* outF, const bam_header_t* header) {
 
   bam_out = samopen(outF, "wb", out_header);
   general_assert(bam_out != 0, "Cannot write to " + cstrtos(outF), "!");
+  if (nThreads > 1 && bgzf_set_write_threads(bam_out->x.bam, nThreads) != 0)
+    fprintf(stderr, "Cannot start threads for writing %s, writing it on one thread!\n", outF);
 
   bam_header_destroy(out_header);
 }
@@ -0,0 +1,230 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include<cstdio>
+#include<cstring>
+#include<cassert>
+#include<string>
+#include<vector>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/types.h>
+
+#include "utils.h"
+#include "my_assert.h"
+
+#include "Alignment.h"
+
+// Binary snapshot of an EM run: the loaded alignments, written once before discretization, and the fractions of
+// multi-read alignments after some round, rewritten every few rounds. Resuming rebuilds the chromosomes from the
+// alignments and continues from the saved fractions, so the input does not have to be parsed again.
+//
+// Layout: Header, the columns of the AlignmentTable, padding to 8 bytes, two copies of the fractions. Saves go to
+// the copy not named by the header and the header is only rewritten once they are on disk, so a run killed while
+// saving leaves the previous snapshot intact. A new checkpoint is built under a temporary name and only replaces a file
+// of the same name once its first state is saved.
+class Checkpoint {
+ public:
+  struct State {
+    int32_t round; // fractions are those after this round, 0 if nothing is saved yet
+    int32_t converged;
+    double objective;
+  };
+
+  Checkpoint() : fo(NULL), published(false), fd(-1), map(NULL), mapSize(0) { memset(&header, 0, sizeof(header)); }
+  ~Checkpoint() { close(); }
+
+  // start a new checkpoint holding the alignments, nSlots is the number of multi-read alignments;
+  // inpF and priorF (empty if there is no prior) are recorded so that a resume can check it uses the same files
+  void create(const char*, const AlignmentTable&, READ_INT_TYPE, CHR_ID_TYPE, int, bool, HIT_INT_TYPE, const char*, const char*);
+
+  // write fracs[0 .. nSlots - 1] as the state after round
+  void save(int, bool, double, const FRAC_TYPE*);
+
+  // size of HIT_INT_TYPE in the build that wrote a checkpoint, 0 if the file is not a checkpoint
+  static int getIndexSize(const char*);
+
+  // map an existing checkpoint read-only and check that it was made with the same settings, input and prior files
+  void open(const char*, int, bool, const char*, const char*);
+
+  READ_INT_TYPE getNumReads() const { return header.n; }
+  CHR_ID_TYPE getNumChroms() const { return header.m; }
+  HIT_INT_TYPE getNumSlots() const { return header.nSlots; }
+  const State& getState() const { return header.states[header.current]; }
+
+  // only valid while open
+  void loadAlignments(AlignmentTable& alignments) const { alignments.readRaw(header.nAmts, map + sizeof(Header)); }
+  const FRAC_TYPE* getFracs() const { return (const FRAC_TYPE*)(map + fracsOffset(header.current)); }
+
+  void close();
+
+ private:
+  struct Header {
+    char magic[8];
+    int32_t typeSizes[5]; // sizes of HIT_INT_TYPE, READ_INT_TYPE, CHR_ID_TYPE, CHR_LEN_TYPE and FRAC_TYPE
+    int32_t fragment_length, extendReads;
+    CHR_ID_TYPE m;
+    READ_INT_TYPE n;
+    HIT_INT_TYPE nAmts, nSlots;
+    int32_t current; // which copy of the fractions holds the latest state
+    State states[2];
+    int64_t inputSize; // size of the input file, to catch a resume with the wrong input
+    int64_t priorSize; // size of the prior file, -1 if there is none
+    uint64_t priorHash; // FNV-1a hash of the prior file's contents
+  };
+
+  static const char MAGIC[8];
+
+  std::string fileName, tmpName;
+  Header header;
+
+  FILE *fo;
+  bool published; // if fo has been renamed from tmpName to fileName
+
+  int fd;
+  const char *map;
+  size_t mapSize;
+
+  off_t fracsOffset(int copy) const {
+    off_t offset = sizeof(Header) + AlignmentTable::rawSize(header.nAmts);
+    offset = (offset + 7) / 8 * 8;
+    return offset + (off_t)copy * header.nSlots * sizeof(FRAC_TYPE);
+  }
+
+  void writeAt(off_t, const void*, size_t);
+  void sync();
+
+  static int64_t fileSize(const char*);
+  static uint64_t fileHash(const char*);
+};
+
+const char Checkpoint::MAGIC[8] = {'C', 'S', 'E', 'M', 'C', 'K', 'P', '2'};
+
+// magic and typeSizes lead the header in every build
+int Checkpoint::getIndexSize(const char* fileName) {
+  char magic[8];
+  int32_t hitSize;
+  FILE *fi = fopen(fileName, "rb");
+
+  if (fi == NULL) return 0;
+  if (fread(magic, 1, 8, fi) != 8 || memcmp(magic, MAGIC, 8) || fread(&hitSize, 4, 1, fi) != 1) hitSize = 0;
+  fclose(fi);
+
+  return hitSize;
+}
+
+void Checkpoint::create(const char* fileName, const AlignmentTable& alignments, READ_INT_TYPE n, CHR_ID_TYPE m, int fragment_length, bool extendReads, HIT_INT_TYPE nSlots, const char* inpF, const char* priorF) {
+  close();
+  this->fileName = fileName;
+  tmpName = this->fileName + ".tmp";
+  published = false;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.typeSizes[0] = sizeof(HIT_INT_TYPE); header.typeSizes[1] = sizeof(READ_INT_TYPE);
+  header.typeSizes[2] = sizeof(CHR_ID_TYPE); header.typeSizes[3] = sizeof(CHR_LEN_TYPE);
+  header.typeSizes[4] = sizeof(FRAC_TYPE);
+  header.fragment_length = fragment_length;
+  header.extendReads = extendReads;
+  header.m = m; header.n = n;
+  header.nAmts = alignments.size(); header.nSlots = nSlots;
+  header.current = 0;
+  header.inputSize = fileSize(inpF);
+  header.priorSize = (priorF[0] != 0 ? fileSize(priorF) : -1);
+  header.priorHash = (priorF[0] != 0 ? fileHash(priorF) : 0);
+
+  fo = fopen(tmpName.c_str(), "w+b");
+  general_assert(fo != NULL, "Cannot write to " + tmpName + "!");
+  general_assert(fwrite(&header, sizeof(header), 1, fo) == 1, "Fail to write to " + this->fileName + "!");
+  alignments.writeRaw(fo);
+  general_assert(fflush(fo) == 0 && ftruncate(fileno(fo), fracsOffset(2)) == 0, "Fail to write to " + this->fileName + "!"); // padding and fractions are zero-filled
+  sync();
+}
+
+void Checkpoint::save(int round, bool converged, double objective, const FRAC_TYPE* fracs) {
+  int next = 1 - header.current;
+
+  assert(fo != NULL);
+  writeAt(fracsOffset(next), fracs, header.nSlots * sizeof(FRAC_TYPE));
+  sync();
+
+  header.current = next;
+  header.states[next].round = round;
+  header.states[next].converged = converged;
+  header.states[next].objective = objective;
+  writeAt(0, &header, sizeof(header));
+  sync();
+
+  if (!published) {
+    general_assert(rename(tmpName.c_str(), fileName.c_str()) == 0, "Cannot rename " + tmpName + " to " + fileName + "!");
+    published = true;
+  }
+
+  fprintf(stderr, "Checkpoint of ROUND %d is saved to %s.\n", round, fileName.c_str());
+}
+
+void Checkpoint::open(const char* fileName, int fragment_length, bool extendReads, const char* inpF, const char* priorF) {
+  struct stat st;
+
+  close();
+  this->fileName = fileName;
+
+  fd = ::open(fileName, O_RDONLY);
+  general_assert(fd >= 0, "Cannot open " + this->fileName + "!");
+  general_assert(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header), this->fileName + " is not a checkpoint!");
+  mapSize = st.st_size;
+  map = (const char*)mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  general_assert(map != MAP_FAILED, "Cannot map " + this->fileName + "!");
+
+  memcpy(&header, map, sizeof(header));
+  general_assert(!memcmp(header.magic, MAGIC, sizeof(MAGIC)), this->fileName + " is not a checkpoint!");
+  general_assert(header.typeSizes[0] == sizeof(HIT_INT_TYPE) && header.typeSizes[1] == sizeof(READ_INT_TYPE) &&
+		 header.typeSizes[2] == sizeof(CHR_ID_TYPE) && header.typeSizes[3] == sizeof(CHR_LEN_TYPE) && header.typeSizes[4] == sizeof(FRAC_TYPE), this->fileName + " was written by a build with different integer or floating-point types!");
+  general_assert(mapSize >= (size_t)fracsOffset(2), this->fileName + " is truncated!");
+  general_assert(header.fragment_length == fragment_length && header.extendReads == extendReads, this->fileName + " was made with a different fragment length or --extend-reads setting!");
+  general_assert(header.inputSize == fileSize(inpF), this->fileName + " was not made from " + cstrtos(inpF) + "!");
+  if (priorF[0] != 0) general_assert(header.priorSize == fileSize(priorF) && header.priorHash == fileHash(priorF), this->fileName + " was not made with prior " + cstrtos(priorF) + "!");
+  else general_assert(header.priorSize < 0, this->fileName + " was made with a prior file, but --prior is not set!");
+  general_assert(getState().round > 0, this->fileName + " does not hold any EM round yet!");
+}
+
+void Checkpoint::close() {
+  if (fo != NULL) {
+    fclose(fo); fo = NULL;
+    if (!published) remove(tmpName.c_str());
+  }
+  if (map != NULL) { munmap((void*)map, mapSize); map = NULL; mapSize = 0; }
+  if (fd >= 0) { ::close(fd); fd = -1; }
+}
+
+void Checkpoint::writeAt(off_t offset, const void* data, size_t size) {
+  general_assert(fseeko(fo, offset, SEEK_SET) == 0 && fwrite(data, 1, size, fo) == size, "Fail to write to " + fileName + "!");
+}
+
+void Checkpoint::sync() {
+  general_assert(fflush(fo) == 0 && fsync(fileno(fo)) == 0, "Fail to write to " + fileName + "!");
+}
+
+int64_t Checkpoint::fileSize(const char* fileName) {
+  struct stat st;
+  general_assert(stat(fileName, &st) == 0, "Cannot access " + cstrtos(fileName) + "!");
+  return st.st_size;
+}
+
+uint64_t Checkpoint::fileHash(const char* fileName) {
+  std::vector<unsigned char> buf(1 << 20);
+  uint64_t hash = 14695981039346656037ULL;
+  size_t len;
+  FILE *fi = fopen(fileName, "rb");
+
+  general_assert(fi != NULL, "Cannot open " + cstrtos(fileName) + "!");
+  while ((len = fread(&buf[0], 1, buf.size(), fi)) > 0)
+    for (size_t i = 0; i < len; i++) hash = (hash ^ buf[i]) * 1099511628211ULL;
+  fclose(fi);
+
+  return hash;
+}
+
+#endif
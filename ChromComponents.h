@@ -0,0 +1,87 @@
+#ifndef CHROMCOMPONENTS_H_
+#define CHROMCOMPONENTS_H_
+
+#include<cassert>
+#include<vector>
+
+#include "utils.h"
+#include "UnionFind.h"
+
+// Chromosomes linked by multi-reads, found by union-find. A multi-read joins the chromosomes of all its alignments,
+// so the EM of one component never looks at another one and components can be solved separately.
+class ChromComponents {
+ public:
+  ChromComponents(CHR_ID_TYPE);
+
+  void join(CHR_ID_TYPE a, CHR_ID_TYPE b) { uf.join(a, b); }
+  CHR_ID_TYPE find(CHR_ID_TYPE c) { return uf.find(c); }
+
+  // count alignments on a chromosome, isMulti if they belong to multi-reads
+  void addAlignments(CHR_ID_TYPE cid, HIT_INT_TYPE count, bool isMulti) {
+    amts[cid] += count;
+    if (isMulti) hasMulti[cid] = true;
+  }
+
+  // Pack the components holding multi-reads into buckets of about bucketSize alignments, in chromosome order.
+  // A component larger than bucketSize gets a bucket of its own. bucketSize is raised if more than maxBuckets
+  // buckets would be needed. Returns the number of buckets.
+  int buildBuckets(HIT_INT_TYPE& bucketSize, int maxBuckets);
+
+  // bucket of the component holding chromosome cid, -1 if the component has no multi-reads
+  int getBucket(CHR_ID_TYPE cid) const { return bucketOf[cid]; }
+
+  HIT_INT_TYPE getBucketSize(int bucket) const { return bucketAmts[bucket]; }
+
+ private:
+  CHR_ID_TYPE m;
+  UnionFind uf;
+  std::vector<HIT_INT_TYPE> amts;
+  std::vector<bool> hasMulti;
+
+  std::vector<int> bucketOf; // per chromosome, filled by buildBuckets
+  std::vector<HIT_INT_TYPE> bucketAmts;
+};
+
+ChromComponents::ChromComponents(CHR_ID_TYPE m) : m(m), uf(m) {
+  amts.assign(m, 0);
+  hasMulti.assign(m, false);
+  bucketOf.assign(m, -1);
+  bucketAmts.clear();
+}
+
+int ChromComponents::buildBuckets(HIT_INT_TYPE& bucketSize, int maxBuckets) {
+  std::vector<HIT_INT_TYPE> compAmts(m, 0);
+  std::vector<bool> compMulti(m, false);
+  std::vector<int> compBucket(m, -1);
+  HIT_INT_TYPE total = 0, current = 0;
+
+  for (CHR_ID_TYPE i = 0; i < m; i++) {
+    CHR_ID_TYPE r = find(i);
+    compAmts[r] += amts[i];
+    if (hasMulti[i]) compMulti[r] = true;
+  }
+  for (CHR_ID_TYPE i = 0; i < m; i++)
+    if (find(i) == i && compMulti[i]) total += compAmts[i];
+
+  // two neighbouring buckets always hold more than bucketSize alignments together
+  assert(maxBuckets > 1);
+  if (bucketSize < total / ((maxBuckets - 1) / 2) + 1) bucketSize = total / ((maxBuckets - 1) / 2) + 1;
+
+  bucketAmts.clear();
+  for (CHR_ID_TYPE i = 0; i < m; i++) {
+    if (find(i) != i || !compMulti[i]) continue;
+    if (bucketAmts.empty() || (current > 0 && current + compAmts[i] > bucketSize)) {
+      bucketAmts.push_back(0);
+      current = 0;
+    }
+    compBucket[i] = bucketAmts.size() - 1;
+    current += compAmts[i];
+    bucketAmts.back() += compAmts[i];
+  }
+
+  for (CHR_ID_TYPE i = 0; i < m; i++) bucketOf[i] = compBucket[find(i)];
+
+  return bucketAmts.size();
+}
+
+#endif
@@ -1,11 +1,11 @@
 #ifndef CHROMTABLE_H_
 #define CHROMTABLE_H_
 
+#include<ctime>
 #include<cstdio>
 #include<cassert>
 #include<string>
 #include<vector>
-#include<fstream>
 #include<algorithm>
 #include<pthread.h>
 
@@ -15,154 +15,524 @@
 #include "ChrMap.h"
 #include "Alignment.h"
 #include "Chromosome.h"
-#include "PThreadWrapper.h"
+#include "ThreadPool.h"
+#include "PriorFile.h"
+#include "Numa.h"
 
 class ChromTable {
  public:
-  ChromTable(ChrMap*, std::vector<Alignment>&, int, int, const char*);
+  ChromTable(ChrMap*, const AlignmentTable&, int, ThreadPool*, const char*);
   ~ChromTable();
 
-  void update(bool);
+  // FULL recomputes all window sums; ACTIVE only adds values changed by more than the active threshold into
+  // the window sums and lists the affected coordinates, see getChangedCoords; VALUES_ONLY leaves window sums alone
+  enum UpdateType { VALUES_ONLY, FULL, ACTIVE };
+
+  void update(UpdateType);
+
+  // update() split into three steps, so that callers can run update_per_thread inside their own pool jobs
+  void prepareUpdate(UpdateType);
+  void update_per_thread(int);
+  void finishUpdate();
+
+  void setActiveThreshold(double threshold) { activeThreshold = threshold; }
+
+  // ACTIVE updates only recompute the values at these coordinates, sorted indices into weights whose fracs changed
+  // since the last update; NULL recomputes all values
+  void setActiveCoords(const std::vector<HIT_INT_TYPE>* coords) { activeCoords = coords; }
+
+  // append the coordinates whose window sums the last ACTIVE update changed, in increasing order
+  void getChangedCoords(std::vector<HIT_INT_TYPE>&) const;
 
   double getMaxDelta() { return max_delta; }
 
+  // coords[begin .. end - 1] of one chromosome, a range no window reaches into from outside (see Chromosome::getClusters)
+  struct Cluster {
+    CHR_ID_TYPE cid;
+    CHR_LEN_TYPE begin, end;
+    HIT_INT_TYPE firstCoord, size; // firstCoord, index of coords[begin] in weights; size, number of multi-read alignments
+
+    Cluster(CHR_ID_TYPE cid, CHR_LEN_TYPE begin, CHR_LEN_TYPE end, HIT_INT_TYPE firstCoord, HIT_INT_TYPE size) : cid(cid), begin(begin), end(end), firstCoord(firstCoord), size(size) {}
+  };
+
+  // clusters of all chromosomes, in the order of their coordinates in weights
+  void getClusters(std::vector<Cluster>&) const;
+
+  // update one cluster on the calling thread, returns the maximum change of values; the cluster is updated shard by
+  // shard as restrictTo cuts it, so that it gets the same values whether it is updated here or by the pool
+  double updateCluster(const Cluster&, bool, std::vector<double>&);
+
+  // restrict FULL and VALUES_ONLY updates to the given clusters, which are cut into shards as usual; NULL lifts the restriction
+  void restrictTo(const std::vector<Cluster>*);
+
+  // fractions of multi-read alignments, sorted by chromosome and position
+  std::vector<FRAC_TYPE>& getFracs() { return fracs; }
+
+  // window sums of the distinct multi-read positions, sorted by chromosome and position; initial ones right after construction
+  std::vector<FRAC_TYPE>& getWeights() { return weights; }
+
+  // slot and coordinate of each multi-read alignment, in the order they appear in "alignments"
+  const std::vector<HIT_INT_TYPE>& getSlots() const { return slots; }
+  const std::vector<HIT_INT_TYPE>& getCoordIds() const { return coordIds; }
+
+  // NUMA mode: move slots and coordIds to pages placed by the threads reading them, see placeByThreads
+  void placeSlots(const std::vector<size_t>& bounds) {
+    placeByThreads(pool, slots, bounds);
+    placeByThreads(pool, coordIds, bounds);
+  }
+
  private:
   CHR_ID_TYPE m;
   HIT_INT_TYPE nAmts;
   int halfws, nThreads;
   double max_delta;
 
-  bool updateFracs; // if update the frac fields of the alignments vector
+  UpdateType updateType;
+  double activeThreshold;
+  const std::vector<HIT_INT_TYPE> *activeCoords;
 
   ChrMap* chrMap;
 
-  std::vector<Alignment> &alignments;
+  const AlignmentTable &alignments;
   std::vector<Chromosome*> chroms_multi; 
 
+  std::vector<FRAC_TYPE> fracs, weights;
+  std::vector<HIT_INT_TYPE> slots, coordIds;
+
+  // A shard updates coords[begin .. end - 1] of one chromosome. Chromosomes with more than SHARD_SIZE multi-read
+  // alignments are split into several shards for FULL and VALUES_ONLY updates. Shard boundaries do not depend on
+  // the number of threads. ACTIVE updates add changes across shard boundaries and always use whole chromosomes.
+  static const HIT_INT_TYPE SHARD_SIZE = 1 << 16;
+
+  struct Shard {
+    CHR_ID_TYPE cid;
+    CHR_LEN_TYPE begin, end;
+    double cost; // seconds taken by the last update, estimated from the number of alignments before that
+    double max_delta;
+
+    Shard(CHR_ID_TYPE cid, CHR_LEN_TYPE begin, CHR_LEN_TYPE end, double cost) : cid(cid), begin(begin), end(end), cost(cost), max_delta(0.0) {}
+  };
+
+  std::vector<Shard> shards, wholeChroms, restricted;
+  std::vector<Shard> *tasks; // shards (or restricted, if set by restrictTo) or wholeChroms, depending on the update type
+  bool isRestricted;
+
+  // each thread starts with its own queue of shards, taken from the head; idle threads steal from the tails of others
   struct Params {
     int no;
     ChromTable *pointer;
-    std::vector<CHR_ID_TYPE> chroms;
-    
-    Params(int no, ChromTable *pointer) { this->no = no; this->pointer = pointer; chroms.clear(); }
+    std::vector<int> queue;
+    int head, tail;
+    std::vector<double> prefix; // scratch space for Chromosome updates
+
+    Params(int no, ChromTable *pointer) { this->no = no; this->pointer = pointer; queue.clear(); head = tail = 0; }
   };
 
   std::vector<Params> paramsArray;
-  PThreadWrapper pthreadWrapper;
-
+  std::vector<void*> paramsPointers; // arguments for pool->run
+  std::vector<pthread_mutex_t> queueLocks;
+  ThreadPool *pool;
+
+  // NUMA mode, on if the pool is pinned: each chromosome has a home node, whose threads discretize it, so that its
+  // arrays are first touched there, and take all of its shards; threads only steal from threads of their own node
+  bool numa;
+  std::vector<int> homeNode;
+  std::vector<std::vector<int> > groups; // threads sharing a node, a single group of all threads without NUMA mode
+  std::vector<int> groupOf, rankOf; // group of each thread and its place there
+
+  // discretization, see discretize
+  enum Stage { PREPARE, INIT };
+  Stage stage;
+  std::vector<Shard> chromTasks;
+  std::vector<HIT_INT_TYPE> firstSlots, firstCoords, slotOf, coordOf;
+
+  // binary prior being loaded, and the entry of each chromosome in it (-1 if none)
+  const PriorFile *priorFile;
+  std::vector<int> priorIds;
+  std::vector<double> groupvalues; // prior counts minus one
+
+  void assign_home_nodes();
+  void discretize(Stage);
+  void discretize_per_thread(int);
   void loadPrior(const char*);
-  void assign_chromosomes_to_threads();
-  void update_per_thread(Params*);
+  void loadTextPrior(const char*);
+  void loadBinaryPrior(const char*);
+  void loadPrior_per_thread(int);
+  void build_shards();
+  void cut_shards(CHR_ID_TYPE, CHR_LEN_TYPE, CHR_LEN_TYPE, std::vector<Shard>&);
+  CHR_LEN_TYPE shard_end(const Chromosome*, CHR_LEN_TYPE, CHR_LEN_TYPE) const;
+  void assign_shards_to_threads();
+  int nextShard(int);
 
   static void* update_per_thread_wrapper(void* args) {
     Params *params = (Params*)args;
-    params->pointer->update_per_thread(params);
+    params->pointer->update_per_thread(params->no);
+    return NULL;
+  }
+
+  static void* discretize_per_thread_wrapper(void* args) {
+    Params *params = (Params*)args;
+    params->pointer->discretize_per_thread(params->no);
+    return NULL;
+  }
+
+  static void* loadPrior_per_thread_wrapper(void* args) {
+    Params *params = (Params*)args;
+    params->pointer->loadPrior_per_thread(params->no);
     return NULL;
   }
 };
 
-ChromTable::ChromTable(ChrMap* chrMap, std::vector<Alignment>& alignments, int halfws, int nThreads, const char* priorF) : halfws(halfws), nThreads(nThreads), chrMap(chrMap), alignments(alignments) {
+ChromTable::ChromTable(ChrMap* chrMap, const AlignmentTable& alignments, int halfws, ThreadPool* pool, const char* priorF) : halfws(halfws), nThreads(pool->getNumThreads()), chrMap(chrMap), alignments(alignments), pool(pool) {
 
   m = chrMap->size();
   nAmts = alignments.size();
 
   max_delta = 0.0;
-  updateFracs = true;
+  updateType = FULL;
+  activeThreshold = 0.0;
+  activeCoords = NULL;
+  priorFile = NULL;
 
-  // initialize chroms_multi
-  for (CHR_ID_TYPE i = 0; i < m; i++) chroms_multi.push_back(new Chromosome(halfws, chrMap->getLen(i), alignments));
-  for (HIT_INT_TYPE i = 0; i < nAmts; i++) chroms_multi[alignments[i].cid]->addPos(i, alignments[i].isMulti);
-  for (CHR_ID_TYPE i = 0; i < m; i++) chroms_multi[i]->init();
+  paramsArray.clear();
+  for (int i = 0; i < nThreads; i++) paramsArray.push_back(Params(i, this));
+  paramsPointers.clear();
+  for (int i = 0; i < nThreads; i++) paramsPointers.push_back((void*)(&paramsArray[i]));
+
+  queueLocks.assign(nThreads, pthread_mutex_t());
+  for (int i = 0; i < nThreads; i++) pthread_mutex_init(&queueLocks[i], NULL);
+
+  numa = pool->isPinned();
+  groups.assign(numa ? pool->getNumNodes() : 1, std::vector<int>());
+  groupOf.assign(nThreads, 0); rankOf.assign(nThreads, 0);
+  for (int i = 0; i < nThreads; i++) {
+    groupOf[i] = (numa ? pool->getNode(i) : 0);
+    rankOf[i] = groups[groupOf[i]].size();
+    groups[groupOf[i]].push_back(i);
+  }
+
+  // initialize chroms_multi, counting the alignments of each chromosome first
+  std::vector<HIT_INT_TYPE> nMultiOf(m, 0), nUniqOf(m, 0);
+  for (HIT_INT_TYPE i = 0; i < nAmts; i++) ++(alignments.isMulti(i) ? nMultiOf : nUniqOf)[alignments.getCid(i)];
+  for (CHR_ID_TYPE i = 0; i < m; i++) {
+    chroms_multi.push_back(new Chromosome(halfws, chrMap->getLen(i), alignments, fracs, weights));
+    chroms_multi[i]->reserve(nMultiOf[i], nUniqOf[i]);
+  }
+  for (HIT_INT_TYPE i = 0; i < nAmts; i++) chroms_multi[alignments.getCid(i)]->addPos(i, alignments.isMulti(i));
+  if (numa) assign_home_nodes();
+
+  discretize(PREPARE);
+
+  // lay out multi-read alignments chromosome by chromosome, so that each chromosome updates a contiguous range of fracs
+  HIT_INT_TYPE nSlots = 0, nCoords = 0;
+  firstSlots.assign(m, 0); firstCoords.assign(m, 0);
+  for (CHR_ID_TYPE i = 0; i < m; i++) {
+    firstSlots[i] = nSlots; firstCoords[i] = nCoords;
+    nSlots += chroms_multi[i]->getSize();
+    nCoords += chroms_multi[i]->getNumCoords();
+  }
+  fracs.assign(nSlots, 0.0);
+  weights.assign(nCoords, 0.0);
+  if (numa) {
+    releasePages(fracs);
+    releasePages(weights);
+  }
+
+  slotOf.assign(nAmts, 0); coordOf.assign(nAmts, 0);
+  discretize(INIT);
+
+  slots.clear(); coordIds.clear();
+  slots.reserve(nSlots); coordIds.reserve(nSlots);
+  for (HIT_INT_TYPE i = 0; i < nAmts; i++) 
+    if (alignments.isMulti(i)) {
+      slots.push_back(slotOf[i]);
+      coordIds.push_back(coordOf[i]);
+    }
+  std::vector<HIT_INT_TYPE>().swap(slotOf);
+  std::vector<HIT_INT_TYPE>().swap(coordOf);
 
   printf("Discretization is performed!\n");
 
   if (priorF[0] != 0) loadPrior(priorF);
 
-  assign_chromosomes_to_threads();
+  build_shards();
 
   printf("ChromTable is constructed!\n");
 }
 
 ChromTable::~ChromTable() {
+  for (int i = 0; i < nThreads; i++) pthread_mutex_destroy(&queueLocks[i]);
   for (CHR_ID_TYPE i = 0; i < m; i++) delete chroms_multi[i];
 }
 
-void ChromTable::loadPrior(const char* priorF) {
-  int ngroups; // number of groups
-  std::vector<double> groupvalues;
-  std::string cname, line;
+// Longest processing time first over the nodes, in proportion to their threads. Costs are numbers of alignments.
+void ChromTable::assign_home_nodes() {
+  std::vector<std::pair<double, CHR_ID_TYPE> > order;
+  std::vector<double> loads(groups.size(), 0.0);
+  int best;
 
-  std::ifstream fin(priorF);
+  for (CHR_ID_TYPE i = 0; i < m; i++) order.push_back(std::make_pair(-(double)(chroms_multi[i]->getSize() + chroms_multi[i]->getNumUniq()), i));
+  std::sort(order.begin(), order.end());
 
-  fin>>ngroups;
-  groupvalues.assign(ngroups, 0.0);
-  for (int i = 0; i < ngroups; i++) {
-    fin>>groupvalues[i];
-    --groupvalues[i]; // deduct one
+  homeNode.assign(m, 0);
+  for (CHR_ID_TYPE i = 0; i < m; i++) {
+    best = -1;
+    for (int j = 0; j < (int)groups.size(); j++)
+      if (!groups[j].empty() && (best < 0 || loads[j] / groups[j].size() < loads[best] / groups[best].size())) best = j;
+    homeNode[order[i].second] = best;
+    loads[best] -= order[i].first;
   }
+}
+
+// PREPARE sorts the alignments of each chromosome, INIT builds its arrays (see Chromosome::prepare and init).
+// Chromosomes are handed out to the pool like shards, in NUMA mode only to the threads of their home nodes.
+// Chromosomes write disjoint parts of fracs, weights, slotOf and coordOf, so the result does not depend on the threads.
+void ChromTable::discretize(Stage stage) {
+  this->stage = stage;
+
+  chromTasks.clear();
+  for (CHR_ID_TYPE i = 0; i < m; i++) chromTasks.push_back(Shard(i, 0, 0, chroms_multi[i]->getSize() + chroms_multi[i]->getNumUniq()));
+  tasks = &chromTasks;
+  assign_shards_to_threads();
+  pool->run(discretize_per_thread_wrapper, paramsPointers);
+  tasks = NULL;
+}
+
+void ChromTable::discretize_per_thread(int no) {
+  int task;
 
-  while (fin>>cname) {
-    getline(fin, line);
-    CHR_ID_TYPE cid = chrMap->getCid(cname);
-    chroms_multi[cid]->processPriorInfo(line, ngroups, groupvalues);
+  while ((task = nextShard(no)) >= 0) {
+    CHR_ID_TYPE cid = (*tasks)[task].cid;
+    if (stage == PREPARE) chroms_multi[cid]->prepare();
+    else chroms_multi[cid]->init(firstSlots[cid], firstCoords[cid], slotOf, coordOf);
   }
+}
 
-  fin.close();
+// Only chromosomes with multi-read positions need prior counts, the others are skipped without being parsed
+void ChromTable::loadPrior(const char* priorF) {
+  if (PriorFile::isBinary(priorF)) loadBinaryPrior(priorF);
+  else loadTextPrior(priorF);
   printf("Prior information are loaded and processed!\n");
 }
 
-void ChromTable::assign_chromosomes_to_threads() {
-  HIT_INT_TYPE avghits, curhits;
-  int curthread;
+void ChromTable::loadTextPrior(const char* priorF) {
+  FILE *fi;
+  char *line = NULL, *p, *q;
+  size_t capacity = 0;
+  std::vector<CHR_LEN_TYPE> lens;
+  std::vector<int32_t> gids;
+
+  fi = fopen(priorF, "r");
+  general_assert(fi != NULL, "Cannot open " + cstrtos(priorF) + "!");
+
+  PriorFile::readTextHeader(fi, priorF, groupvalues);
+  for (size_t i = 0; i < groupvalues.size(); i++) --groupvalues[i]; // deduct one
+
+  while (getline(&line, &capacity, fi) >= 0) {
+    for (p = line; isspace(*p); ++p) ;
+    if (*p == 0) continue;
+    for (q = p; *q && !isspace(*q); ++q) ;
+    CHR_ID_TYPE cid = chrMap->getCid(std::string(p, q - p));
+    if (chroms_multi[cid]->getNumCoords() == 0) continue;
+    PriorFile::parseRuns(q, lens, gids);
+    chroms_multi[cid]->processPriorInfo(lens.size(), lens.empty() ? NULL : &lens[0], gids.empty() ? NULL : &gids[0], groupvalues);
+  }
 
-  avghits = 0;
-  for (CHR_ID_TYPE i = 0; i < m; i++) avghits += chroms_multi[i]->getSize();
-  avghits /= nThreads;
+  free(line);
+  fclose(fi);
+}
 
-  paramsArray.clear();
-  curhits = 0; curthread = 0;
-  paramsArray.push_back(Params(curthread, this));
+// chromosomes are processed in parallel, one task each, handed out like shards
+void ChromTable::loadBinaryPrior(const char* priorF) {
+  PriorFile prior(priorF);
+  std::vector<Shard> loads;
+  CHR_LEN_TYPE nCoords;
+
+  groupvalues.assign(prior.getGroupValues(), prior.getGroupValues() + prior.getNumGroups());
+  for (size_t i = 0; i < groupvalues.size(); i++) --groupvalues[i]; // deduct one
+
+  priorIds.assign(m, -1);
+  for (int i = 0; i < prior.getNumChroms(); i++) {
+    CHR_ID_TYPE cid = chrMap->getCid(prior.getName(i));
+    general_assert(priorIds[cid] < 0, prior.getName(i) + " appears more than once in " + cstrtos(priorF) + "!");
+    priorIds[cid] = i;
+    nCoords = chroms_multi[cid]->getNumCoords();
+    if (nCoords > 0) loads.push_back(Shard(cid, 0, nCoords, prior.getNumRuns(i) + nCoords));
+  }
+
+  priorFile = &prior;
+  tasks = &loads;
+  assign_shards_to_threads();
+  pool->run(loadPrior_per_thread_wrapper, paramsPointers);
+  tasks = &shards;
+  priorFile = NULL;
+}
+
+void ChromTable::loadPrior_per_thread(int no) {
+  int task, id;
+
+  while ((task = nextShard(no)) >= 0) {
+    CHR_ID_TYPE cid = (*tasks)[task].cid;
+    id = priorIds[cid];
+    chroms_multi[cid]->processPriorInfo(priorFile->getNumRuns(id), priorFile->getLens(id), priorFile->getGids(id), groupvalues);
+  }
+}
+
+void ChromTable::build_shards() {
+  CHR_LEN_TYPE nCoords;
+
+  shards.clear(); wholeChroms.clear();
   for (CHR_ID_TYPE i = 0; i < m; i++) {
-    paramsArray[curthread].chroms.push_back(i);
-    curhits += chroms_multi[i]->getSize();
+    nCoords = chroms_multi[i]->getNumCoords();
+    if (nCoords == 0) continue; // nothing to update
 
-    if (curthread + 1 < nThreads && i + 1 < m && (curhits >= avghits || nThreads - curthread - 1 >= m - i - 1)) {
-      curthread++; curhits = 0;
-      paramsArray.push_back(Params(curthread, this));
-    }
+    wholeChroms.push_back(Shard(i, 0, nCoords, chroms_multi[i]->getSize() + nCoords));
+    cut_shards(i, 0, nCoords, shards);
   }
+  restricted.clear();
+  isRestricted = false;
 
-  pthreadWrapper.num_threads_used = paramsArray.size();
-  pthreadWrapper.threads.assign(pthreadWrapper.num_threads_used, pthread_t());
+  tasks = &shards;
 
-  printf("Jobs are assigned!\n");
+  printf("%d chromosomes are split into %d shards!\n", (int)wholeChroms.size(), (int)shards.size());
 }
 
-void ChromTable::update_per_thread(Params* params) {
-  for (size_t i = 0; i < params->chroms.size(); i++) {
-    CHR_ID_TYPE chrom_id = params->chroms[i];
-    chroms_multi[chrom_id]->update(updateFracs);
+// cut coords[begin .. end - 1] of chromosome cid into shards, alignments at one coordinate always stay in one shard
+void ChromTable::cut_shards(CHR_ID_TYPE cid, CHR_LEN_TYPE begin, CHR_LEN_TYPE end, std::vector<Shard>& out) {
+  Chromosome *chrom = chroms_multi[cid];
+  CHR_LEN_TYPE j;
+
+  for (CHR_LEN_TYPE first = begin; first < end; first = j) {
+    j = shard_end(chrom, first, end);
+    out.push_back(Shard(cid, first, j, chrom->getRangeSize(first, j) + (j - first)));
   }
 }
 
-//multi-threading
-void ChromTable::update(bool updateFracs = true) {
-  this->updateFracs = updateFracs; 
+// the end of the shard starting at coords[first], within coords[first .. end - 1]
+inline CHR_LEN_TYPE ChromTable::shard_end(const Chromosome* chrom, CHR_LEN_TYPE first, CHR_LEN_TYPE end) const {
+  CHR_LEN_TYPE j = first + 1;
+  while (j < end && chrom->getRangeSize(first, j + 1) <= SHARD_SIZE) ++j;
+  return j;
+}
+
+double ChromTable::updateCluster(const Cluster& c, bool updateWeight, std::vector<double>& prefix) {
+  Chromosome *chrom = chroms_multi[c.cid];
+  CHR_LEN_TYPE j;
+  double max_delta = 0.0;
 
-  // create threads
-  for (int i = 0; i < pthreadWrapper.num_threads_used; i++) {
-    pthreadWrapper.rc = pthread_create(&pthreadWrapper.threads[i], &pthreadWrapper.attr, update_per_thread_wrapper, (void*)(&paramsArray[i]));
-    pthread_assert(pthreadWrapper.rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) when ChromTable is being updated!");
+  for (CHR_LEN_TYPE first = c.begin; first < c.end; first = j) {
+    j = shard_end(chrom, first, c.end);
+    max_delta = std::max(max_delta, chrom->update(first, j, updateWeight, prefix));
   }
-  // join threads
-  for (int i = 0; i < pthreadWrapper.num_threads_used; i++) {
-    pthreadWrapper.rc = pthread_join(pthreadWrapper.threads[i], NULL);
-    pthread_assert(pthreadWrapper.rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) when ChromTable is being updated!");
+
+  return max_delta;
+}
+
+void ChromTable::getClusters(std::vector<Cluster>& clusters) const {
+  std::vector<std::pair<CHR_LEN_TYPE, CHR_LEN_TYPE> > ranges;
+
+  clusters.clear();
+  for (CHR_ID_TYPE i = 0; i < m; i++) {
+    Chromosome *chrom = chroms_multi[i];
+    chrom->getClusters(ranges);
+    for (size_t j = 0; j < ranges.size(); j++)
+      clusters.push_back(Cluster(i, ranges[j].first, ranges[j].second, chrom->getFirstCoord() + ranges[j].first, chrom->getRangeSize(ranges[j].first, ranges[j].second)));
   }
+}
 
-  // update max_delta
+void ChromTable::restrictTo(const std::vector<Cluster>* clusters) {
+  restricted.clear();
+  isRestricted = (clusters != NULL);
+  if (clusters != NULL)
+    for (size_t i = 0; i < clusters->size(); i++) cut_shards((*clusters)[i].cid, (*clusters)[i].begin, (*clusters)[i].end, restricted);
+}
+
+// Longest processing time first: shards are handed out by decreasing cost, each to the least loaded thread
+// (of the chromosome's home node in NUMA mode). Costs are those measured in the last update of the same kind,
+// work stealing absorbs the remaining imbalance.
+void ChromTable::assign_shards_to_threads() {
+  std::vector<std::pair<double, int> > order;
+  std::vector<double> loads(nThreads, 0.0);
+  int ntasks = tasks->size(), best;
+
+  order.clear();
+  for (int i = 0; i < ntasks; i++) order.push_back(std::make_pair(-(*tasks)[i].cost, i));
+  std::sort(order.begin(), order.end());
+
+  for (int i = 0; i < nThreads; i++) paramsArray[i].queue.clear();
+  for (int i = 0; i < ntasks; i++) {
+    const std::vector<int>& group = groups[numa ? homeNode[(*tasks)[order[i].second].cid] : 0];
+    best = group[0];
+    for (size_t j = 1; j < group.size(); j++)
+      if (loads[group[j]] < loads[best]) best = group[j];
+    paramsArray[best].queue.push_back(order[i].second);
+    loads[best] -= order[i].first;
+  }
+
+  for (int i = 0; i < nThreads; i++) {
+    paramsArray[i].head = 0;
+    paramsArray[i].tail = paramsArray[i].queue.size();
+  }
+}
+
+// returns the next shard for thread no, or -1 if no shard is left to it; threads steal within their group only
+int ChromTable::nextShard(int no) {
+  const std::vector<int>& group = groups[groupOf[no]];
+  int rc, task = -1, size = group.size();
+
+  for (int i = 0; i < size && task < 0; i++) {
+    int v = group[(rankOf[no] + i) % size];
+    Params& params = paramsArray[v];
+
+    rc = pthread_mutex_lock(&queueLocks[v]);
+    pthread_assert(rc, "pthread_mutex_lock", "Cannot lock a shard queue!");
+    if (params.head < params.tail) task = (v == no ? params.queue[params.head++] : params.queue[--params.tail]);
+    rc = pthread_mutex_unlock(&queueLocks[v]);
+    pthread_assert(rc, "pthread_mutex_unlock", "Cannot unlock a shard queue!");
+  }
+
+  return task;
+}
+
+void ChromTable::prepareUpdate(UpdateType updateType) {
+  this->updateType = updateType;
+  tasks = (updateType == ACTIVE ? &wholeChroms : (isRestricted ? &restricted : &shards));
+  assign_shards_to_threads();
+}
+
+void ChromTable::update_per_thread(int no) {
+  struct timespec start, end;
+  int task;
+
+  while ((task = nextShard(no)) >= 0) {
+    Shard& shard = (*tasks)[task];
+    Chromosome *chrom = chroms_multi[shard.cid];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (updateType == ACTIVE) shard.max_delta = chrom->updateActive(activeThreshold, activeCoords, paramsArray[no].prefix);
+    else shard.max_delta = chrom->update(shard.begin, shard.end, updateType == FULL, paramsArray[no].prefix);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    shard.cost = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  }
+}
+
+void ChromTable::finishUpdate() {
   max_delta = 0.0;
-  for (CHR_ID_TYPE i = 0; i < m; i++) max_delta = std::max(max_delta, chroms_multi[i]->getMaxDelta());
+  for (size_t i = 0; i < tasks->size(); i++) max_delta = std::max(max_delta, (*tasks)[i].max_delta);
+}
+
+void ChromTable::getChangedCoords(std::vector<HIT_INT_TYPE>& list) const {
+  for (size_t i = 0; i < wholeChroms.size(); i++) {
+    const std::vector<HIT_INT_TYPE>& changedCoords = chroms_multi[wholeChroms[i].cid]->getChangedCoords();
+    list.insert(list.end(), changedCoords.begin(), changedCoords.end());
+  }
+}
+
+//multi-threading
+void ChromTable::update(UpdateType updateType) {
+  prepareUpdate(updateType);
+  pool->run(update_per_thread_wrapper, paramsPointers);
+  finishUpdate();
 }
 
 #endif
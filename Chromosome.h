@@ -3,7 +3,6 @@
 
 #include<cmath>
 #include<cassert>
-#include<sstream>
 #include<vector>
 #include<algorithm>
 
@@ -11,145 +10,214 @@
 
 #include "Alignment.h"
 #include "ArrayScan.h"
+#include "SimdKernels.h"
+#include "RadixSort.h"
 
 class Chromosome {
  public:
-  Chromosome(int, CHR_LEN_TYPE, std::vector<Alignment>&);
-  Chromosome(const Chromosome&); // this is only used for sorting!
+  Chromosome(int, CHR_LEN_TYPE, const AlignmentTable&, std::vector<FRAC_TYPE>&, std::vector<FRAC_TYPE>&);
 
   HIT_INT_TYPE getSize() const { return size; }
+  HIT_INT_TYPE getNumCoords() const { return s; }
+  HIT_INT_TYPE getFirstCoord() const { return firstCoord; }
+  HIT_INT_TYPE getNumUniq() const { return usize; }
 
+  // number of multi-read alignments at coords[begin .. end - 1]
+  HIT_INT_TYPE getRangeSize(CHR_LEN_TYPE begin, CHR_LEN_TYPE end) const { return coordStarts[end] - coordStarts[begin]; }
+
+  void reserve(HIT_INT_TYPE, HIT_INT_TYPE);
   void addPos(HIT_INT_TYPE, bool);
-  void init();
-  void processPriorInfo(const std::string&, int, const std::vector<double>&);
-  void update(bool);
+  void prepare();
+  void init(HIT_INT_TYPE, HIT_INT_TYPE, std::vector<HIT_INT_TYPE>&, std::vector<HIT_INT_TYPE>&);
+  void processPriorInfo(CHR_LEN_TYPE, const CHR_LEN_TYPE*, const int32_t*, const std::vector<double>&);
 
-  double getMaxDelta() const { return max_delta; }
+  // Split coords into clusters [begin, end), cut wherever two neighbouring coords are more than halfws apart.
+  // No window reaches across a cut, so clusters can be updated on their own.
+  void getClusters(std::vector<std::pair<CHR_LEN_TYPE, CHR_LEN_TYPE> >&) const;
 
-  bool operator()(HIT_INT_TYPE a, HIT_INT_TYPE b) const {
-    return alignments[a].pos < alignments[b].pos;
-  }
+  // both return the maximum change of values, prefix is scratch space owned by the calling thread
+  double update(CHR_LEN_TYPE, CHR_LEN_TYPE, bool, std::vector<double>&);
+  double updateActive(double, const std::vector<HIT_INT_TYPE>*, std::vector<double>&);
+
+  // indices into weights of the window sums changed by the last updateActive, in increasing order
+  const std::vector<HIT_INT_TYPE>& getChangedCoords() const { return changedCoords; }
 
   
  private:
   int halfws;
   CHR_LEN_TYPE clen; // chromosome length
-  std::vector<Alignment>& alignments; 
+  const AlignmentTable& alignments; 
+  std::vector<FRAC_TYPE>& fracs; // multi-read fractions in slot order, shared by all chromosomes
+  std::vector<FRAC_TYPE>& weights; // window sums in coordinate order, shared by all chromosomes
+  HIT_INT_TYPE firstCoord; // coords[i] is weights[firstCoord + i]
 
 
   HIT_INT_TYPE size; // size, total number of alignments
-  std::vector<HIT_INT_TYPE> alignPos; // positions in "alignments" vector for multi-reads
+  std::vector<HIT_INT_TYPE> alignPos; // positions in "alignments" vector for multi-reads, released after init
+  std::vector<uint32_t> alignKeys; // genomic coordinate - keyBase of each alignPos, from prepare to init
+  CHR_LEN_TYPE keyBase;
 
   CHR_LEN_TYPE s, offset; // s, total number of unique multi-read alignment positions; offset, where genomic coordinate >= 0
   std::vector<CHR_LEN_TYPE> coords; // discretized coordinates for multi-read alignments
+  std::vector<HIT_INT_TYPE> coordStarts; // slots of alignments at coords[i] are [coordStarts[i], coordStarts[i + 1])
 
-  std::vector<CHR_LEN_TYPE> lengths; // this vector is used by ArrayScan
-  std::vector<double> values; // multiread fractions
+  std::vector<FRAC_TYPE> values; // multiread fractions, the ones already added into weights
 
-  std::vector<HIT_INT_TYPE> uniqPos; // positions in "alignments" vector for unique reads
+  // the window of coords[i] covers values[windowLB[i] .. windowUB[i] - 1], so its multi-read sum is a difference
+  // of two prefix sums over values; the bounds are found once in init
+  std::vector<CHR_LEN_TYPE> windowLB, windowUB;
 
-  std::vector<double> baseWindowSums; // constant part of sum in a window, including unique reads and prior counts 
-  std::vector<double> basePointValues; // point values at multi-read positions, including unique reads and prior info
+  HIT_INT_TYPE usize; // number of unique-read alignments
+  std::vector<HIT_INT_TYPE> uniqPos; // positions in "alignments" vector for unique reads, released by prepare
+  std::vector<uint32_t> uniqKeys; // sorted genomic coordinates of unique reads inside the chromosome, from prepare to init
 
-  double max_delta;
+  std::vector<FRAC_TYPE> baseWindowSums; // constant part of sum in a window, including unique reads and prior counts 
+  std::vector<FRAC_TYPE> basePointValues; // point values at multi-read positions, including unique reads and prior info
+
+  // scratch space for updateActive
+  std::vector<CHR_LEN_TYPE> changedIdx;
+  std::vector<double> changedDelta;
+  std::vector<HIT_INT_TYPE> changedCoords;
+
+  FRAC_TYPE getValue(CHR_LEN_TYPE) const;
+  void updateWeights(CHR_LEN_TYPE, CHR_LEN_TYPE, CHR_LEN_TYPE, CHR_LEN_TYPE, std::vector<double>&);
 };
 
-Chromosome::Chromosome(int halfws, CHR_LEN_TYPE clen, std::vector<Alignment>& alignments) : halfws(halfws), clen(clen), alignments(alignments) { 
-  size = 0; 
+Chromosome::Chromosome(int halfws, CHR_LEN_TYPE clen, const AlignmentTable& alignments, std::vector<FRAC_TYPE>& fracs, std::vector<FRAC_TYPE>& weights) : halfws(halfws), clen(clen), alignments(alignments), fracs(fracs), weights(weights) { 
+  size = 0; usize = 0;
+  s = 0; firstCoord = 0; keyBase = 0;
   alignPos.clear();
   uniqPos.clear();
-  max_delta = 0.0;
 }
 
-Chromosome::Chromosome(const Chromosome& o) : alignments(o.alignments) { }
+void Chromosome::reserve(HIT_INT_TYPE nMulti, HIT_INT_TYPE nUniq) {
+  alignPos.reserve(nMulti);
+  uniqPos.reserve(nUniq);
+}
 
 inline void Chromosome::addPos(HIT_INT_TYPE pos, bool isMulti) {
   if (isMulti) { alignPos.push_back(pos); ++size; }
-  else { uniqPos.push_back(pos); }
+  else { uniqPos.push_back(pos); ++usize; }
 }
 
-void Chromosome::init() {
-  CHR_LEN_TYPE pos; 
-  CHR_LEN_TYPE prevpos, curpos, curidx; // these two are for genomic coordinates >= 0 && < clen only
-  HIT_INT_TYPE usize; // usize, size of uniqPos
+// Sort the alignments by position and count the distinct multi-read positions, getNumCoords() is valid afterwards.
+// Positions are read from "alignments" once and radix sorted as keys; alignments at one position keep the order of
+// their ids. The sorted arrays are written by the calling thread, and so sit on its NUMA node.
+void Chromosome::prepare() {
+  CHR_LEN_TYPE pos;
+
+  assert(size == (HIT_INT_TYPE)alignPos.size());
+  keyBase = 0;
+  for (HIT_INT_TYPE i = 0; i < size; i++) {
+    pos = alignments.getPos(alignPos[i]);
+    if (i == 0 || pos < keyBase) keyBase = pos;
+  }
+  alignKeys.resize(size);
+  for (HIT_INT_TYPE i = 0; i < size; i++) alignKeys[i] = (uint32_t)(alignments.getPos(alignPos[i]) - keyBase);
+  radixSort(alignKeys, &alignPos);
 
-  std::vector<CHR_LEN_TYPE> lens;
-  std::vector<double> vals;
+  s = 0;
+  for (HIT_INT_TYPE i = 0; i < size; i++)
+    if (i == 0 || alignKeys[i] != alignKeys[i - 1]) ++s;
 
-  // for multi-read alignments
+  // unique reads outside of the chromosome never count
+  uniqKeys.clear();
+  for (HIT_INT_TYPE i = 0; i < usize; i++) {
+    pos = alignments.getPos(uniqPos[i]);
+    if (pos >= 0 && pos < clen) uniqKeys.push_back(pos);
+  }
+  std::vector<HIT_INT_TYPE>().swap(uniqPos);
+  radixSort(uniqKeys);
+}
+
+// Multi-read alignments of this chromosome occupy slots [firstSlot, firstSlot + size) in position order
+// and their distinct positions occupy weights[firstCoord, firstCoord + s).
+// slotOf/coordOf[alignment id] are set and weights gets the initial window sums,
+// which are the lengths of the windows lying inside the chromosome. Its range of fracs is zeroed here as well,
+// so that its pages are first touched by the thread that later updates this chromosome.
+void Chromosome::init(HIT_INT_TYPE firstSlot, HIT_INT_TYPE firstCoord, std::vector<HIT_INT_TYPE>& slotOf, std::vector<HIT_INT_TYPE>& coordOf) {
+  CHR_LEN_TYPE pos; 
+  CHR_LEN_TYPE prevpos; // for genomic coordinates >= 0 && < clen only
+
+  // for multi-read alignments, sorted by prepare
   assert(size == (HIT_INT_TYPE)alignPos.size());
-  std::sort(alignPos.begin(), alignPos.end(), *this);
+  std::fill(fracs.begin() + firstSlot, fracs.begin() + firstSlot + size, 0.0);
 
-  coords.clear();
-  s = 0; offset = -1; 
+  this->firstCoord = firstCoord;
+  coords.clear(); coords.reserve(s);
+  coordStarts.clear(); coordStarts.reserve(s + 1);
+  offset = -1; 
   prevpos = -1;
-  lengths.clear();
+  values.clear();
   for (HIT_INT_TYPE i = 0; i < size; i++) {
-    pos = alignments[alignPos[i]].pos;
-    if (i + 1 == size || pos != alignments[alignPos[i + 1]].pos) {
+    pos = keyBase + (CHR_LEN_TYPE)alignKeys[i];
+    if (i == 0 || alignKeys[i] != alignKeys[i - 1]) {
+      weights[firstCoord + coords.size()] = std::min(clen - 1, pos + halfws) - std::max(-1, pos - halfws - 1);
+      coordStarts.push_back(firstSlot + i);
+    }
+    slotOf[alignPos[i]] = firstSlot + i;
+    coordOf[alignPos[i]] = firstCoord + coords.size();
+    if (i + 1 == size || alignKeys[i] != alignKeys[i + 1]) {
       if (pos >= 0 && pos < clen) {
 	if (offset < 0) offset = coords.size();
 	assert(prevpos < pos);
-	lengths.push_back(pos - prevpos);
+	values.push_back(0.0);
 	prevpos = pos;
       }
       coords.push_back(pos);
     }
   }
-  s = coords.size();
-  values.assign(lengths.size(), 0.0);
-
-  assert(offset < 0 || ((offset < 1 || coords[offset - 1] < 0) && (coords[offset] >= 0 && coords[offset] < clen)));
-
-  // for unique-read alignments
-  std::sort(uniqPos.begin(), uniqPos.end(), *this);
-
-  usize = uniqPos.size(); 
-  curpos = -1; curidx = -1;
-  lens.clear(); vals.clear();
-  for (HIT_INT_TYPE i = 0; i < usize; i++) {
-    pos = alignments[uniqPos[i]].pos;
-    if (pos < 0) continue;
-    if (pos >= clen) break;
-
-    if (curpos < pos) {
-      lens.push_back(pos - curpos);
-      vals.push_back(0.0);
-      curpos = pos; 
-      ++curidx;
+  assert(s == (CHR_LEN_TYPE)coords.size());
+  coordStarts.push_back(firstSlot + size);
+
+  windowLB.assign(s, 0); windowUB.assign(s, 0);
+  if (offset >= 0) {
+    std::vector<CHR_LEN_TYPE>::iterator first = coords.begin() + offset, last = first + values.size();
+    for (CHR_LEN_TYPE i = 0; i < s; i++) {
+      windowLB[i] = std::lower_bound(first, last, coords[i] - halfws) - first;
+      windowUB[i] = std::upper_bound(first, last, coords[i] + halfws) - first;
     }
-    vals[curidx] += alignments[uniqPos[i]].frac;
   }
 
+  // from now on, multi-read alignments are only accessed through their slots
+  std::vector<HIT_INT_TYPE>().swap(alignPos);
+  std::vector<uint32_t>().swap(alignKeys);
 
-  ArrayScan arrScanL(0, lens, vals);
-  ArrayScan arrScanU(0, lens, vals);
-  ArrayScan arrScanM(0, lens, vals);
+  assert(offset < 0 || ((offset < 1 || coords[offset - 1] < 0) && (coords[offset] >= 0 && coords[offset] < clen)));
+
+  // for unique-read alignments, counted between pointers into their sorted positions as coords increase:
+  // uniqKeys[lb .. ub - 1] lie in the window of coords[i] and uniqKeys[pb .. pe - 1] at coords[i]
+  HIT_INT_TYPE nu = uniqKeys.size(), lb = 0, ub = 0, pb = 0, pe = 0;
 
   baseWindowSums.assign(s, 0.0);
   basePointValues.assign(s, 0.0);
 
   for (CHR_LEN_TYPE i = 0; i < s; i++) {
-    baseWindowSums[i] = arrScanU.getSumBy(coords[i] + halfws) - arrScanL.getSumBy(coords[i] - halfws - 1);
-    if (coords[i] >= 0 && coords[i] < clen) basePointValues[i] = arrScanM.getValueAt(coords[i]);
+    pos = coords[i];
+    while (lb < nu && (CHR_LEN_TYPE)uniqKeys[lb] < pos - halfws) ++lb;
+    while (ub < nu && (CHR_LEN_TYPE)uniqKeys[ub] <= pos + halfws) ++ub;
+    baseWindowSums[i] = ub - lb;
+    if (pos >= 0 && pos < clen) {
+      while (pb < nu && (CHR_LEN_TYPE)uniqKeys[pb] < pos) ++pb;
+      if (pe < pb) pe = pb;
+      while (pe < nu && (CHR_LEN_TYPE)uniqKeys[pe] <= pos) ++pe;
+      basePointValues[i] = pe - pb;
+    }
   }
+  std::vector<uint32_t>().swap(uniqKeys);
 }
 
-void Chromosome::processPriorInfo(const std::string& line, int ngroups, const std::vector<double>& groupvalues) {
-  int gid;
-  CHR_LEN_TYPE len;
-  std::istringstream strin(line);
-  std::vector<CHR_LEN_TYPE> lens;
-  std::vector<double> vals;
+// lens[i] positions of the chromosome fall in group gids[i]; groupvalues are the prior counts minus one
+void Chromosome::processPriorInfo(CHR_LEN_TYPE nRuns, const CHR_LEN_TYPE* runLens, const int32_t* gids, const std::vector<double>& groupvalues) {
+  std::vector<CHR_LEN_TYPE> lens(runLens, runLens + nRuns);
+  std::vector<double> vals(nRuns, 0.0);
 
   CHR_LEN_TYPE sum = 0;
 
-  lens.clear(); vals.clear();
-  while (strin>> len>> gid) {
-    lens.push_back(len);
-    assert(gid >= 0 && gid < ngroups);
-    vals.push_back(groupvalues[gid]);
-    sum += len;
+  for (CHR_LEN_TYPE i = 0; i < nRuns; i++) {
+    assert(gids[i] >= 0 && gids[i] < (int)groupvalues.size());
+    vals[i] = groupvalues[gids[i]];
+    sum += lens[i];
   }
 
   assert(sum == clen);
@@ -164,55 +232,122 @@ void Chromosome::processPriorInfo(const std::string& line, int ngroups, const st
   }
 }
 
-void Chromosome::update(bool updateFrac = true) {
-  CHR_LEN_TYPE pos, curidx;
-  double value;
+void Chromosome::getClusters(std::vector<std::pair<CHR_LEN_TYPE, CHR_LEN_TYPE> >& clusters) const {
+  CHR_LEN_TYPE begin = 0;
 
-  // update values
-  max_delta = 0.0;
+  clusters.clear();
+  for (CHR_LEN_TYPE i = 1; i <= s; i++)
+    if (i == s || coords[i] - coords[i - 1] > halfws) {
+      clusters.push_back(std::make_pair(begin, i));
+      begin = i;
+    }
+}
 
-  curidx = offset;
-  value = 0.0;
-  for (HIT_INT_TYPE i = 0; i < size; i++) {
-    pos = alignments[alignPos[i]].pos;
-    if (pos < 0) continue;
-    if (pos >= clen) break;
+// the value of coords[offset + i] implied by the current fracs, rounded as update stores it in values
+inline FRAC_TYPE Chromosome::getValue(CHR_LEN_TYPE i) const {
+  CHR_LEN_TYPE curidx = offset + i;
+  double value = 0.0;
 
-    if (pos > coords[curidx]) {
-      if (value + basePointValues[curidx] < 0.0) value = -basePointValues[curidx];
-      max_delta = std::max(max_delta, fabs(values[curidx - offset] - value));
-      values[curidx - offset] = value;      
+  for (HIT_INT_TYPE j = coordStarts[curidx]; j < coordStarts[curidx + 1]; j++) value += fracs[j];
+  if (value + basePointValues[curidx] < 0.0) value = -basePointValues[curidx];
 
-      ++curidx;
-      value = 0.0;
-    }
+  return value;
+}
+
+// Recompute the values of coords[begin .. end - 1] from fracs and, if updateWeight, their window sums.
+// Values outside of the range but inside its windows are recomputed locally instead of being read from values,
+// so that disjoint ranges of one chromosome can be updated in parallel.
+double Chromosome::update(CHR_LEN_TYPE begin, CHR_LEN_TYPE end, bool updateWeight, std::vector<double>& prefix) {
+  CHR_LEN_TYPE nvals, vb, ve;
+  double max_delta = 0.0;
+
+  // coordinates in [0, clen) are coords[offset .. offset + nvals - 1], values[vb .. ve - 1] belong to this range
+  nvals = values.size();
+  vb = std::min(std::max(begin - offset, 0), nvals);
+  ve = std::min(std::max(end - offset, 0), nvals);
+  if (vb < ve) max_delta = simd_updateValues(ve - vb, &coordStarts[offset + vb], &fracs[0], &basePointValues[offset + vb], &values[vb]);
+
+  if (updateWeight && begin < end) updateWeights(begin, end, vb, ve, prefix);
 
-    value += alignments[alignPos[i]].frac;
+  return max_delta;
+}
+
+// recompute the window sums of coords[begin .. end - 1], values[vb .. ve - 1] are up to date
+void Chromosome::updateWeights(CHR_LEN_TYPE begin, CHR_LEN_TYPE end, CHR_LEN_TYPE vb, CHR_LEN_TYPE ve, std::vector<double>& prefix) {
+  CHR_LEN_TYPE eb = std::min(vb, windowLB[begin]), ee = std::max(ve, windowUB[end - 1]);
+  FRAC_TYPE *weight = &weights[firstCoord];
+
+  // prefix[i - eb] is the sum of values[eb .. i - 1]; it is accumulated in double in every build, so that window
+  // sums stay accurate to float precision in csem-float instead of losing the low bits of the long prefixes
+  prefix.resize(ee - eb + 1);
+  prefix[0] = 0.0;
+  for (CHR_LEN_TYPE i = eb; i < vb; i++) prefix[i - eb + 1] = prefix[i - eb] + getValue(i);
+  for (CHR_LEN_TYPE i = vb; i < ve; i++) prefix[i - eb + 1] = prefix[i - eb] + values[i];
+  for (CHR_LEN_TYPE i = ve; i < ee; i++) prefix[i - eb + 1] = prefix[i - eb] + getValue(i);
+
+  for (CHR_LEN_TYPE i = begin; i < end; i++) {
+    weight[i] = baseWindowSums[i] + (prefix[windowUB[i] - eb] - prefix[windowLB[i] - eb]);
+    assert(weight[i] >= 0.0);
+  }
+}
+
+// Recompute values from fracs, but only values changed by more than threshold are added into the window sums
+// of their neighbours, who are then listed in changedCoords. Smaller changes are kept back until they add up.
+// Only values at the weights indices listed in active, which is sorted, are recomputed; the fracs of the others have
+// not changed since the last update. All values are recomputed if active is NULL.
+// If many values changed, recomputing all window sums is cheaper than adding the changes one by one.
+double Chromosome::updateActive(double threshold, const std::vector<HIT_INT_TYPE>* active, std::vector<double>& prefix) {
+  CHR_LEN_TYPE nvals, i, curidx, lb, ub, done;
+  size_t first, last;
+  double value, delta, max_delta;
+
+  max_delta = 0.0;
+  changedIdx.clear(); changedDelta.clear(); changedCoords.clear();
+
+  nvals = values.size();
+  first = 0; last = nvals;
+  if (active != NULL) {
+    first = std::lower_bound(active->begin(), active->end(), firstCoord) - active->begin();
+    last = std::lower_bound(active->begin() + first, active->end(), firstCoord + s) - active->begin();
   }
-  if (curidx >= 0) {
-    assert(curidx < s && coords[curidx] >= 0 && coords[curidx] < clen);
-    if (value + basePointValues[curidx] < 0.0) value = -basePointValues[curidx];
-    max_delta = std::max(max_delta, fabs(values[curidx - offset] - value));
-    values[curidx - offset] = value;
+  for (size_t l = first; l < last; l++) {
+    i = (active != NULL ? (CHR_LEN_TYPE)((*active)[l] - firstCoord) - offset : (CHR_LEN_TYPE)l);
+    if (i < 0 || i >= nvals) continue; // positions outside of the chromosome have no values
+    value = getValue(i);
+    delta = value - values[i];
+    max_delta = std::max(max_delta, fabs(delta));
+    if (fabs(delta) <= threshold) continue;
+
+    values[i] = value;
+    changedIdx.push_back(offset + i);
+    changedDelta.push_back(delta);
   }
- 
-  if (!updateFrac) return;
 
-  // update alignments.frac for the multi-read alignments in this chromosome
-  ArrayScan arrScanL(0, lengths, values);
-  ArrayScan arrScanU(0, lengths, values);
+  if ((CHR_LEN_TYPE)changedIdx.size() * 4 > s) {
+    if (s > 0) updateWeights(0, s, 0, nvals, prefix);
+    for (CHR_LEN_TYPE k = 0; k < s; k++) changedCoords.push_back(firstCoord + k);
 
-  curidx = -1; value = 0.0;
-  for (HIT_INT_TYPE i = 0; i < size; i++) {
-    pos = alignments[alignPos[i]].pos;
-    if (curidx < 0 || pos > coords[curidx]) {
-      ++curidx;
-      assert(curidx < s && pos == coords[curidx]);
-      value = baseWindowSums[curidx] + (arrScanU.getSumBy(coords[curidx] + halfws) - arrScanL.getSumBy(coords[curidx] - halfws - 1));     
-      assert(value >= 0.0);
+    return max_delta;
+  }
+
+  // changedIdx is increasing and so are the window bounds, coords[done ..] are not listed yet
+  done = 0;
+  for (size_t l = 0; l < changedIdx.size(); l++) {
+    curidx = changedIdx[l];
+    delta = changedDelta[l];
+
+    // the window relation is symmetric, coords[lb .. ub - 1] are the coordinates whose windows contain coords[curidx]
+    lb = std::lower_bound(coords.begin(), coords.begin() + curidx, coords[curidx] - halfws) - coords.begin();
+    ub = std::upper_bound(coords.begin() + curidx, coords.end(), coords[curidx] + halfws) - coords.begin();
+    for (CHR_LEN_TYPE k = lb; k < ub; k++) {
+      weights[firstCoord + k] += delta;
+      if (weights[firstCoord + k] < 0.0) weights[firstCoord + k] = 0.0; // rounding errors
     }
-    alignments[alignPos[i]].frac = value;
+    for (CHR_LEN_TYPE k = std::max(lb, done); k < ub; k++) changedCoords.push_back(firstCoord + k);
+    done = std::max(done, ub);
   }
+
+  return max_delta;
 }
 
 #endif
@@ -0,0 +1,115 @@
+#ifndef INPUTSIZE_H_
+#define INPUTSIZE_H_
+
+#include<cstdio>
+#include<cstring>
+#include<string>
+#include<vector>
+#include<stdint.h>
+#include<zlib.h>
+#include<sys/stat.h>
+
+#include "utils.h"
+#include "my_assert.h"
+
+// Estimate the number of records of a SAM or BAM file without parsing it: the records in the first SAMPLE_SIZE bytes
+// of its data are counted and scaled up by the part of the file on disk that they came from. Plain, gzipped and BGZF
+// files are all read through zlib, whose offset tells how many bytes on disk the sample took. The count is exact
+// if the sample reaches the end of the file. Returns 0 if the size is unknown, e.g. for a pipe or a BAM header
+// larger than the sample.
+const int SAMPLE_SIZE = 1 << 26;
+
+// no SAM line or BAM record is shorter than MIN_RECORD_SIZE bytes, and deflate expands data at most MAX_DEFLATE_RATIO times
+const uint64_t MIN_RECORD_SIZE = 22;
+const uint64_t MAX_DEFLATE_RATIO = 1032;
+
+// a bound on the number of records of inpF from its size alone, cheap enough to skip estimates of small files
+uint64_t maxNumRecords(const char* inpF) {
+  struct stat st;
+  unsigned char magic[2];
+  bool compressed = false;
+  FILE *fi;
+
+  if (stat(inpF, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+  fi = fopen(inpF, "rb");
+  if (fi == NULL) return 0;
+  compressed = fread(magic, 1, 2, fi) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+  fclose(fi);
+
+  return (uint64_t)st.st_size * (compressed ? MAX_DEFLATE_RATIO : 1) / MIN_RECORD_SIZE;
+}
+
+// records are counted once they are complete in buf[0 .. len - 1], or at the end of the file
+uint64_t countSamRecords(const char* buf, int64_t len, bool atEnd) {
+  uint64_t cnt = 0;
+  int64_t p = 0, q;
+
+  while (p < len) {
+    const char *nl = (const char*)memchr(buf + p, '\n', len - p);
+    q = (nl != NULL ? nl - buf : len);
+    if (nl == NULL && !atEnd) break;
+    if (q > p && buf[p] != '@') ++cnt;
+    p = q + 1;
+  }
+
+  return cnt;
+}
+
+// returns false if the header does not fit into the sample
+bool countBamRecords(const char* buf, int64_t len, bool atEnd, uint64_t& cnt) {
+  int32_t l_text, n_ref, l_name, block_size;
+  int64_t p;
+
+  cnt = 0;
+  if (len < 12 || memcmp(buf, "BAM\1", 4)) return atEnd;
+  memcpy(&l_text, buf + 4, 4);
+  p = 8 + (int64_t)l_text;
+  if (p + 4 > len) return false;
+  memcpy(&n_ref, buf + p, 4); p += 4;
+  for (int32_t i = 0; i < n_ref; i++) {
+    if (p + 4 > len) return false;
+    memcpy(&l_name, buf + p, 4);
+    p += 4 + (int64_t)l_name + 4;
+  }
+  if (p > len) return false;
+
+  while (p + 4 <= len) {
+    memcpy(&block_size, buf + p, 4);
+    if (p + 4 + block_size > len) break;
+    p += 4 + (int64_t)block_size;
+    ++cnt;
+  }
+
+  return true;
+}
+
+uint64_t estimateNumRecords(char inpType, const char* inpF) {
+  struct stat st;
+  gzFile gz;
+  std::vector<char> buf(SAMPLE_SIZE);
+  int len;
+  int64_t consumed;
+  uint64_t cnt;
+  bool atEnd;
+
+  if (stat(inpF, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+
+  gz = gzopen(inpF, "rb");
+  general_assert(gz != NULL, "Cannot open " + cstrtos(inpF) + "!");
+  len = gzread(gz, &buf[0], SAMPLE_SIZE);
+  general_assert(len >= 0, "Fail to read " + cstrtos(inpF) + "!");
+  atEnd = len < SAMPLE_SIZE;
+  consumed = gzoffset(gz);
+  gzclose(gz);
+
+  if (inpType == 'b') {
+    if (!countBamRecords(&buf[0], len, atEnd, cnt)) return 0;
+  }
+  else cnt = countSamRecords(&buf[0], len, atEnd);
+
+  if (atEnd) return cnt;
+  if (consumed <= 0) return 0;
+  return (uint64_t)((double)cnt * st.st_size / consumed);
+}
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include<cstdio>
+#include<cstring>
+#include<cstdlib>
+#include<cassert>
+#include<string>
+#include<vector>
+#include<algorithm>
+#include<sched.h>
+#include<dirent.h>
+#include<unistd.h>
+#include<stdint.h>
+#include<sys/mman.h>
+
+#include "utils.h"
+#include "my_assert.h"
+#include "ThreadPool.h"
+
+// NUMA nodes and their CPUs as listed under /sys/devices/system/node, limited to the CPUs this process may run on.
+// Without that directory, all CPUs form a single node. No libnuma is needed: threads are pinned through the
+// thread pool, and memory is placed by the kernel's first-touch policy, on the node of the thread writing a page first.
+class NumaTopology {
+ public:
+  NumaTopology();
+
+  int getNumNodes() const { return nodes.size(); }
+  int getNodeId(int i) const { return nodes[i]; }
+  const std::vector<int>& getCpus(int i) const { return cpus[i]; }
+
+  // Spread nThreads threads over the nodes in proportion to their CPUs, consecutive threads share a node.
+  // cpuOf[i] is the CPU of thread i and nodeOf[i] the index of its node, threads beyond the CPUs of a node share them.
+  void placeThreads(int, std::vector<int>&, std::vector<int>&) const;
+
+ private:
+  std::vector<int> nodes; // node ids
+  std::vector<std::vector<int> > cpus; // allowed CPUs of each node
+
+  static void parseCpuList(const char*, const cpu_set_t&, std::vector<int>&);
+};
+
+NumaTopology::NumaTopology() {
+  const char *path = "/sys/devices/system/node";
+  cpu_set_t allowed;
+  DIR *dir;
+  struct dirent *entry;
+  std::vector<std::pair<int, std::string> > found;
+  std::vector<int> list;
+  char fileName[STRLEN], line[STRLEN];
+  int id;
+
+  CPU_ZERO(&allowed);
+  general_assert(sched_getaffinity(0, sizeof(allowed), &allowed) == 0, "Cannot get the CPUs this process may run on!");
+
+  dir = opendir(path);
+  if (dir != NULL) {
+    while ((entry = readdir(dir)) != NULL)
+      if (sscanf(entry->d_name, "node%d", &id) == 1) found.push_back(std::make_pair(id, std::string(entry->d_name)));
+    closedir(dir);
+  }
+  std::sort(found.begin(), found.end());
+
+  for (size_t i = 0; i < found.size(); i++) {
+    sprintf(fileName, "%s/%s/cpulist", path, found[i].second.c_str());
+    FILE *fi = fopen(fileName, "r");
+    if (fi == NULL) continue;
+    if (fgets(line, STRLEN, fi) != NULL) parseCpuList(line, allowed, list);
+    else list.clear();
+    fclose(fi);
+    if (list.empty()) continue; // memory-only nodes, or nodes whose CPUs are not allowed
+    nodes.push_back(found[i].first);
+    cpus.push_back(list);
+  }
+
+  if (nodes.empty()) {
+    list.clear();
+    for (int c = 0; c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &allowed)) list.push_back(c);
+    nodes.push_back(0);
+    cpus.push_back(list);
+  }
+}
+
+// a cpulist looks like "0-7,16-23"
+void NumaTopology::parseCpuList(const char* p, const cpu_set_t& allowed, std::vector<int>& list) {
+  char *q;
+  long first, last;
+
+  list.clear();
+  while (*p) {
+    first = strtol(p, &q, 10);
+    if (q == p) break;
+    p = q; last = first;
+    if (*p == '-') { ++p; last = strtol(p, &q, 10); p = q; }
+    for (long c = first; c <= last && c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &allowed)) list.push_back(c);
+    if (*p == ',') ++p;
+  }
+}
+
+void NumaTopology::placeThreads(int nThreads, std::vector<int>& cpuOf, std::vector<int>& nodeOf) const {
+  int nNodes = nodes.size(), total = 0, node, before;
+  std::vector<int> ends(nNodes, 0); // CPUs of nodes 0 .. i, in the order of the nodes
+
+  for (int i = 0; i < nNodes; i++) ends[i] = (total += cpus[i].size());
+
+  cpuOf.assign(nThreads, 0); nodeOf.assign(nThreads, 0);
+  node = 0; before = 0;
+  for (int i = 0; i < nThreads; i++) {
+    int k = (int)((int64_t)i * total / nThreads); // thread i takes the place of the k-th CPU
+    if (k >= ends[node]) { node = std::upper_bound(ends.begin(), ends.end(), k) - ends.begin(); before = i; }
+    const std::vector<int>& list = cpus[node];
+    nodeOf[i] = node;
+    cpuOf[i] = list[(i - before) % list.size()];
+  }
+}
+
+// Hand the whole pages of a zero-filled vector back to the kernel. They read as zeros again, and each page is then
+// placed on the node of the thread touching it first. Partial pages at both ends stay where they are.
+template<class T> void releasePages(std::vector<T>& v) {
+  if (v.empty()) return;
+
+  uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = ((uintptr_t)&v[0] + pageSize - 1) / pageSize * pageSize;
+  uintptr_t end = (uintptr_t)(&v[0] + v.size()) / pageSize * pageSize;
+  if (begin < end) madvise((void*)begin, end - begin, MADV_DONTNEED);
+}
+
+template<class T> struct PlaceRange {
+  const std::vector<T> *src;
+  std::vector<T> *dest;
+  size_t begin, end;
+};
+
+template<class T> void* placeRange_per_thread(void* arg) {
+  PlaceRange<T> *range = (PlaceRange<T>*)arg;
+  if (range->begin < range->end) memcpy(&(*range->dest)[range->begin], &(*range->src)[range->begin], (range->end - range->begin) * sizeof(T));
+  return NULL;
+}
+
+// Move v to fresh pages, where v[bounds[i] .. bounds[i + 1] - 1] is written by, and so placed on the node of,
+// worker i of the pool. bounds has one entry more than the pool has threads and ends with v.size().
+template<class T> void placeByThreads(ThreadPool* pool, std::vector<T>& v, const std::vector<size_t>& bounds) {
+  int nThreads = pool->getNumThreads();
+  std::vector<T> placed(v.size());
+  std::vector<PlaceRange<T> > ranges(nThreads);
+  std::vector<void*> args(nThreads);
+
+  assert((int)bounds.size() == nThreads + 1 && bounds[nThreads] == v.size());
+  releasePages(placed);
+  for (int i = 0; i < nThreads; i++) {
+    ranges[i].src = &v; ranges[i].dest = &placed;
+    ranges[i].begin = bounds[i]; ranges[i].end = bounds[i + 1];
+    args[i] = (void*)&ranges[i];
+  }
+  pool->run(placeRange_per_thread<T>, args);
+  v.swap(placed);
+}
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef PRIORFILE_H_
+#define PRIORFILE_H_
+
+#include<cctype>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<cassert>
+#include<string>
+#include<vector>
+#include<fcntl.h>
+#include<unistd.h>
+#include<stdint.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/types.h>
+
+#include "utils.h"
+#include "my_assert.h"
+
+// Prior files give each chromosome a run-length list of (length, group id) pairs, and each group a prior count.
+//
+// Text format: the number of groups and their counts, then one line per chromosome, its name followed by the pairs.
+// Binary format, made by convert: Header, the group counts as doubles, the runs of each chromosome as a column of
+// lengths followed by a column of group ids, and at indexOffset an index of (name length, name, offset of its runs,
+// number of runs) per chromosome. The binary file is memory-mapped, so a loader only touches the chromosomes it needs.
+class PriorFile {
+ public:
+  // map a binary prior file
+  PriorFile(const char*);
+  ~PriorFile();
+
+  static bool isBinary(const char*);
+
+  // write the binary form of a text prior file, one chromosome line at a time
+  static void convert(const char*, const char*);
+
+  // read the group counts at the start of a text prior file
+  static void readTextHeader(FILE*, const char*, std::vector<double>&);
+
+  // parse the pairs of a text line
+  static void parseRuns(const char*, std::vector<CHR_LEN_TYPE>&, std::vector<int32_t>&);
+
+  int getNumGroups() const { return header.ngroups; }
+  const double* getGroupValues() const { return (const double*)(map + sizeof(Header)); }
+
+  int getNumChroms() const { return header.nchroms; }
+  const std::string& getName(int i) const { return names[i]; }
+  int64_t getNumRuns(int i) const { return nRuns[i]; }
+  const CHR_LEN_TYPE* getLens(int i) const { return (const CHR_LEN_TYPE*)(map + offsets[i]); }
+  const int32_t* getGids(int i) const { return (const int32_t*)(map + offsets[i] + nRuns[i] * sizeof(CHR_LEN_TYPE)); }
+
+ private:
+  struct Header {
+    char magic[8];
+    int32_t lenSize; // size of CHR_LEN_TYPE
+    int32_t ngroups, nchroms;
+    int64_t indexOffset;
+  };
+
+  static const char MAGIC[8];
+
+  std::string fileName;
+  Header header;
+  std::vector<std::string> names;
+  std::vector<int64_t> offsets, nRuns;
+
+  int fd;
+  const char *map;
+  size_t mapSize;
+};
+
+const char PriorFile::MAGIC[8] = {'C', 'S', 'E', 'M', 'P', 'R', 'I', '1'};
+
+PriorFile::PriorFile(const char* priorF) : fileName(priorF) {
+  struct stat st;
+  const char *p, *end;
+  int32_t len;
+
+  fd = open(priorF, O_RDONLY);
+  general_assert(fd >= 0, "Cannot open " + fileName + "!");
+  general_assert(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header), fileName + " is not a binary prior file!");
+  mapSize = st.st_size;
+  map = (const char*)mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  general_assert(map != MAP_FAILED, "Cannot map " + fileName + "!");
+
+  memcpy(&header, map, sizeof(header));
+  general_assert(!memcmp(header.magic, MAGIC, sizeof(MAGIC)) && header.indexOffset <= (int64_t)mapSize, fileName + " is not a binary prior file!");
+  general_assert(header.lenSize == sizeof(CHR_LEN_TYPE), fileName + " was written by a build with different integer types!");
+
+  p = map + header.indexOffset; end = map + mapSize;
+  for (int i = 0; i < header.nchroms; i++) {
+    general_assert(p + sizeof(int32_t) <= end, fileName + " is truncated!");
+    memcpy(&len, p, sizeof(int32_t)); p += sizeof(int32_t);
+    general_assert(len >= 0 && p + len + 2 * sizeof(int64_t) <= end, fileName + " is truncated!");
+    names.push_back(std::string(p, len)); p += len;
+    offsets.push_back(0); nRuns.push_back(0);
+    memcpy(&offsets.back(), p, sizeof(int64_t)); p += sizeof(int64_t);
+    memcpy(&nRuns.back(), p, sizeof(int64_t)); p += sizeof(int64_t);
+    general_assert(offsets.back() + nRuns.back() * (int64_t)(sizeof(CHR_LEN_TYPE) + sizeof(int32_t)) <= header.indexOffset, fileName + " is truncated!");
+  }
+}
+
+PriorFile::~PriorFile() {
+  munmap((void*)map, mapSize);
+  close(fd);
+}
+
+bool PriorFile::isBinary(const char* priorF) {
+  char magic[sizeof(MAGIC)];
+  FILE *fi = fopen(priorF, "rb");
+
+  general_assert(fi != NULL, "Cannot open " + cstrtos(priorF) + "!");
+  bool result = fread(magic, 1, sizeof(magic), fi) == sizeof(magic) && !memcmp(magic, MAGIC, sizeof(MAGIC));
+  fclose(fi);
+
+  return result;
+}
+
+void PriorFile::parseRuns(const char* p, std::vector<CHR_LEN_TYPE>& lens, std::vector<int32_t>& gids) {
+  char *q;
+  long len, gid;
+
+  lens.clear(); gids.clear();
+  while (true) {
+    len = strtol(p, &q, 10);
+    if (q == p) break;
+    p = q;
+    gid = strtol(p, &q, 10);
+    if (q == p) break;
+    p = q;
+    lens.push_back(len);
+    gids.push_back(gid);
+  }
+}
+
+void PriorFile::readTextHeader(FILE* fi, const char* priorF, std::vector<double>& groupvalues) {
+  int ngroups;
+
+  general_assert(fscanf(fi, "%d", &ngroups) == 1 && ngroups >= 0, "Cannot read the number of groups from " + cstrtos(priorF) + "!");
+  groupvalues.assign(ngroups, 0.0);
+  for (int i = 0; i < ngroups; i++)
+    general_assert(fscanf(fi, "%lf", &groupvalues[i]) == 1, "Cannot read the prior counts from " + cstrtos(priorF) + "!");
+}
+
+void PriorFile::convert(const char* textF, const char* binaryF) {
+  FILE *fi, *fo;
+  Header header;
+  std::vector<double> groupvalues;
+  std::vector<std::string> names;
+  std::vector<int64_t> offsets, nRuns;
+  std::vector<CHR_LEN_TYPE> lens;
+  std::vector<int32_t> gids;
+  char *line = NULL, *p, *q;
+  size_t capacity = 0;
+  int64_t offset;
+
+  fi = fopen(textF, "r");
+  general_assert(fi != NULL, "Cannot open " + cstrtos(textF) + "!");
+  fo = fopen(binaryF, "wb");
+  general_assert(fo != NULL, "Cannot write to " + cstrtos(binaryF) + "!");
+
+  readTextHeader(fi, textF, groupvalues);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.lenSize = sizeof(CHR_LEN_TYPE);
+  header.ngroups = groupvalues.size();
+  general_assert(fwrite(&header, sizeof(header), 1, fo) == 1 && (groupvalues.empty() || fwrite(&groupvalues[0], sizeof(double), groupvalues.size(), fo) == groupvalues.size()), "Fail to write to " + cstrtos(binaryF) + "!");
+  offset = sizeof(header) + groupvalues.size() * sizeof(double);
+
+  while (getline(&line, &capacity, fi) >= 0) {
+    for (p = line; isspace(*p); ++p) ;
+    if (*p == 0) continue;
+    for (q = p; *q && !isspace(*q); ++q) ;
+    names.push_back(std::string(p, q - p));
+
+    parseRuns(q, lens, gids);
+    for (size_t i = 0; i < gids.size(); i++)
+      general_assert(gids[i] >= 0 && gids[i] < header.ngroups, "Invalid group id for " + names.back() + " in " + cstrtos(textF) + "!");
+
+    offsets.push_back(offset); nRuns.push_back(lens.size());
+    if (!lens.empty())
+      general_assert(fwrite(&lens[0], sizeof(CHR_LEN_TYPE), lens.size(), fo) == lens.size() &&
+		     fwrite(&gids[0], sizeof(int32_t), gids.size(), fo) == gids.size(), "Fail to write to " + cstrtos(binaryF) + "!");
+    offset += lens.size() * (sizeof(CHR_LEN_TYPE) + sizeof(int32_t));
+  }
+  free(line);
+  fclose(fi);
+
+  header.nchroms = names.size();
+  header.indexOffset = offset;
+  for (size_t i = 0; i < names.size(); i++) {
+    int32_t len = names[i].length();
+    general_assert(fwrite(&len, sizeof(int32_t), 1, fo) == 1 && fwrite(names[i].c_str(), 1, len, fo) == (size_t)len &&
+		   fwrite(&offsets[i], sizeof(int64_t), 1, fo) == 1 && fwrite(&nRuns[i], sizeof(int64_t), 1, fo) == 1, "Fail to write to " + cstrtos(binaryF) + "!");
+  }
+  general_assert(fseeko(fo, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fo) == 1, "Fail to write to " + cstrtos(binaryF) + "!");
+  general_assert(fclose(fo) == 0, "Fail to write to " + cstrtos(binaryF) + "!");
+
+  printf("%d chromosomes are converted from %s to %s!\n", header.nchroms, textF, binaryF);
+}
+
+#endif
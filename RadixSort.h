@@ -0,0 +1,64 @@
+#ifndef RADIXSORT_H_
+#define RADIXSORT_H_
+
+#include<cassert>
+#include<vector>
+#include<algorithm>
+#include<stdint.h>
+
+// Stable LSD radix sort of keys, carrying vals (if not NULL) along. Each pass sorts RADIX_BITS bits, passes above
+// the highest bit of the largest key are skipped, so keys should be offsets from the smallest one.
+// Equal keys keep their input order, inputs shorter than RADIX_CUTOFF are insertion sorted instead.
+const int RADIX_BITS = 11;
+const size_t RADIX_CUTOFF = 64;
+
+template<class T> void radixSort(std::vector<uint32_t>& keys, std::vector<T>* vals) {
+  size_t n = keys.size();
+  uint32_t maxKey = 0;
+
+  assert(vals == NULL || vals->size() == n);
+  if (n < 2) return;
+
+  if (n < RADIX_CUTOFF) {
+    for (size_t i = 1; i < n; i++) {
+      uint32_t key = keys[i];
+      size_t j = i;
+      if (vals != NULL) {
+	T val = (*vals)[i];
+	for (; j > 0 && keys[j - 1] > key; j--) { keys[j] = keys[j - 1]; (*vals)[j] = (*vals)[j - 1]; }
+	(*vals)[j] = val;
+      }
+      else for (; j > 0 && keys[j - 1] > key; j--) keys[j] = keys[j - 1];
+      keys[j] = key;
+    }
+    return;
+  }
+
+  const uint32_t nBuckets = 1 << RADIX_BITS, mask = nBuckets - 1;
+  std::vector<uint32_t> keys2(n);
+  std::vector<T> vals2(vals != NULL ? n : 0);
+  std::vector<size_t> counts(nBuckets);
+
+  for (size_t i = 0; i < n; i++) maxKey = std::max(maxKey, keys[i]);
+
+  for (int shift = 0; shift < 32 && (maxKey >> shift) > 0; shift += RADIX_BITS) {
+    std::fill(counts.begin(), counts.end(), 0);
+    for (size_t i = 0; i < n; i++) ++counts[(keys[i] >> shift) & mask];
+    size_t sum = 0;
+    for (uint32_t b = 0; b < nBuckets; b++) { size_t c = counts[b]; counts[b] = sum; sum += c; }
+
+    for (size_t i = 0; i < n; i++) {
+      size_t to = counts[(keys[i] >> shift) & mask]++;
+      keys2[to] = keys[i];
+      if (vals != NULL) vals2[to] = (*vals)[i];
+    }
+    keys.swap(keys2);
+    if (vals != NULL) vals->swap(vals2);
+  }
+}
+
+inline void radixSort(std::vector<uint32_t>& keys) {
+  radixSort<uint32_t>(keys, NULL);
+}
+
+#endif
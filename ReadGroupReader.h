@@ -0,0 +1,83 @@
+// ReadGroupReader for csem
+
+#ifndef READGROUPREADER_H_
+#define READGROUPREADER_H_
+
+#include<cstdio>
+#include<vector>
+#include<algorithm>
+
+#include "utils.h"
+
+#include "BamAlignment.h"
+#include "SamParser.h"
+
+// Hands out the aligned records of the input one read at a time, a read being a run of aligned records with the
+// same name (unaligned records in between are skipped). Records live in a pool which every read reuses and names
+// are compared in place, so once the pool has grown to the largest read no memory is allocated per record.
+class ReadGroupReader {
+ public:
+  // if copy is not NULL, every record read, aligned or not, is also written to it by writeRaw
+  ReadGroupReader(SamParser*, FILE* = NULL);
+  ~ReadGroupReader();
+
+  // move to the next read, returns false if there is none
+  bool next();
+
+  // alignments of the current read
+  int size() const { return n; }
+  BamAlignment& operator[](int i) { return *pool[i]; }
+
+  // number of records read from the input so far, including unaligned ones
+  uint64_t getNumRecords() const { return nRecords; }
+
+ private:
+  SamParser *parser;
+  FILE *copy;
+
+  std::vector<BamAlignment*> pool; // pool[0 .. n - 1] holds the current read, pool[n] the first record of the next if pending
+  int n;
+  bool pending, eof;
+  uint64_t nRecords; // 64 bits in every build, so that csem can tell when its indices would overflow
+
+  // read the next aligned record into pool[i], returns false at the end of input
+  bool readAligned(int);
+};
+
+ReadGroupReader::ReadGroupReader(SamParser* parser, FILE* copy) : parser(parser), copy(copy) {
+  pool.clear();
+  n = 0;
+  pending = eof = false;
+  nRecords = 0;
+}
+
+ReadGroupReader::~ReadGroupReader() {
+  for (size_t i = 0; i < pool.size(); i++) delete pool[i];
+}
+
+bool ReadGroupReader::next() {
+  if (pending) std::swap(pool[0], pool[n]);
+  else if (!readAligned(0)) { n = 0; return false; }
+
+  n = 1;
+  while ((pending = readAligned(n)) && pool[n]->hasSameName(*pool[0])) ++n;
+
+  return true;
+}
+
+bool ReadGroupReader::readAligned(int i) {
+  if (eof) return false;
+  if (i == (int)pool.size()) pool.push_back(new BamAlignment());
+
+  BamAlignment &b = *pool[i];
+  while (parser->next(b)) {
+    ++nRecords;
+    if (copy != NULL) b.writeRaw(copy);
+    if (b.isAligned()) return true;
+  }
+  eof = true;
+
+  return false;
+}
+
+#endif
@@ -20,7 +20,7 @@
 
 class SamParser {
  public:
-  SamParser(char, const char*, const char* = 0);
+  SamParser(char, const char*, const char* = 0, int = 1);
   ~SamParser();
 
   const bam_header_t* getHeader() const { 
@@ -35,7 +35,8 @@ class SamParser {
 };
 
 // aux, if not 0, points to the file name of fn_list
-SamParser::SamParser(char inpType, const char* inpF, const char* aux) {
+// nThreads > 1 inflates BAM input or parses SAM input on nThreads background threads
+SamParser::SamParser(char inpType, const char* inpF, const char* aux, int nThreads) {
   switch(inpType) {
   case 'b': sam_in = samopen(inpF, "rb", aux); break;
   case 's': sam_in = samopen(inpF, "r", aux); break;
@@ -45,6 +46,11 @@ SamParser::SamParser(char inpType, const char* inpF, const char* aux) {
   general_assert(sam_in != 0, "Cannot open " + cstrtos(inpF) + "! It may not exist.");
   header = sam_in->header;
   general_assert(header != 0, "Fail to parse the header!");
+
+  if (inpType == 'b' && nThreads > 1 && bgzf_set_read_threads(sam_in->x.bam, nThreads) != 0)
+    fprintf(stderr, "Cannot start threads for reading %s, reading it on one thread!\n", inpF);
+  if (inpType == 's' && nThreads > 1 && sam_set_read_threads(sam_in->x.tamr, header, nThreads) != 0)
+    fprintf(stderr, "Cannot start threads for parsing %s, parsing it on one thread!\n", inpF);
 }
 
 SamParser::~SamParser() {
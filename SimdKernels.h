@@ -0,0 +1,285 @@
+#ifndef SIMDKERNELS_H_
+#define SIMDKERNELS_H_
+
+#include<cmath>
+#include<algorithm>
+
+#include "utils.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include<immintrin.h>
+#endif
+
+// Vectorized kernels for the EM inner loops, the instruction set is chosen at run time by simd_init.
+// All kernels give the same results as their scalar versions, only the order of independent operations differs.
+
+enum SimdLevel { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+
+SimdLevel simd_level = SIMD_SCALAR;
+
+// reads are normalized in batches of SIMD_BATCH reads with the same number of alignments, one read per vector lane;
+// the h-th alignment of the l-th read in a batch is stored at [h * SIMD_BATCH + l]
+const int SIMD_BATCH = 8;
+
+void simd_init(bool enable) {
+  simd_level = SIMD_SCALAR;
+#ifdef SIMD_X86
+  if (!enable) return;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) simd_level = SIMD_AVX2;
+#ifndef CSEM_FLOAT
+  // a batch of SIMD_BATCH floats already fills an AVX2 register, so csem-float has no AVX-512 kernels
+  if (__builtin_cpu_supports("avx512f")) simd_level = SIMD_AVX512;
+#endif
+#endif
+}
+
+const char* simd_name() {
+  return simd_level == SIMD_AVX512 ? "AVX-512" : (simd_level == SIMD_AVX2 ? "AVX2" : "scalar");
+}
+
+// Normalize one batch of reads with k alignments each. Fractions are window sums divided by their read's total,
+// a read whose total is <= 0 is allocated uniformly. tots receives the SIMD_BATCH totals.
+
+void normalizeBatch_scalar(int k, const HIT_INT_TYPE* coordIds, const HIT_INT_TYPE* slots, const FRAC_TYPE* weights, FRAC_TYPE* fracs, double* tots) {
+  for (int l = 0; l < SIMD_BATCH; l++) {
+    FRAC_TYPE tot = 0.0;
+    for (int h = 0; h < k; h++) tot += weights[coordIds[h * SIMD_BATCH + l]];
+    tots[l] = tot;
+    if (tot <= 0.0) tot = k;
+    for (int h = 0; h < k; h++) fracs[slots[h * SIMD_BATCH + l]] = weights[coordIds[h * SIMD_BATCH + l]] / tot;
+  }
+}
+
+// Set values[i] to the sum of fracs[starts[i] .. starts[i + 1] - 1], raised to -base[i] if lower, and return the
+// maximum absolute change of values.
+
+double updateValues_scalar(int n, const HIT_INT_TYPE* starts, const FRAC_TYPE* fracs, const FRAC_TYPE* base, FRAC_TYPE* values) {
+  double sum, max_delta = 0.0;
+  FRAC_TYPE value, delta;
+
+  for (int i = 0; i < n; i++) {
+    sum = 0.0;
+    for (HIT_INT_TYPE j = starts[i]; j < starts[i + 1]; j++) sum += fracs[j];
+    value = (sum + base[i] < 0.0 ? -base[i] : sum);
+    delta = values[i] - value;
+    max_delta = std::max(max_delta, fabs((double)delta));
+    values[i] = value;
+  }
+
+  return max_delta;
+}
+
+#if defined(SIMD_X86) && !defined(CSEM_FLOAT)
+
+// load 4 (avx2) or 8 (avx512) hit indices as the 64-bit lanes the gathers take
+__attribute__((target("avx2")))
+inline __m256i loadIndices_avx2(const HIT_INT_TYPE* p) {
+#ifdef CSEM64
+  return _mm256_loadu_si256((const __m256i*)p);
+#else
+  return _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)p));
+#endif
+}
+
+__attribute__((target("avx512f")))
+inline __m512i loadIndices_avx512(const HIT_INT_TYPE* p) {
+#ifdef CSEM64
+  return _mm512_loadu_si512((const void*)p);
+#else
+  return _mm512_maskz_cvtepu32_epi64(0xFF, _mm256_loadu_si256((const __m256i*)p));
+#endif
+}
+
+__attribute__((target("avx2")))
+void normalizeBatch_avx2(int k, const HIT_INT_TYPE* coordIds, const HIT_INT_TYPE* slots, const double* weights, double* fracs, double* tots) {
+  const __m256d zero = _mm256_setzero_pd(), uniform = _mm256_set1_pd((double)k);
+  __m256d tot, w;
+  __m256i idx;
+  double buf[4];
+
+  // AVX2 has four double lanes, so the batch is handled in two halves
+  for (int half = 0; half < SIMD_BATCH; half += 4) {
+    tot = zero;
+    for (int h = 0; h < k; h++) {
+      idx = loadIndices_avx2(coordIds + h * SIMD_BATCH + half);
+      tot = _mm256_add_pd(tot, _mm256_i64gather_pd(weights, idx, 8));
+    }
+    _mm256_storeu_pd(tots + half, tot);
+    tot = _mm256_blendv_pd(tot, uniform, _mm256_cmp_pd(tot, zero, _CMP_LE_OQ));
+
+    for (int h = 0; h < k; h++) {
+      idx = loadIndices_avx2(coordIds + h * SIMD_BATCH + half);
+      w = _mm256_div_pd(_mm256_i64gather_pd(weights, idx, 8), tot);
+      _mm256_storeu_pd(buf, w);
+      const HIT_INT_TYPE *s = slots + h * SIMD_BATCH + half;
+      fracs[s[0]] = buf[0]; fracs[s[1]] = buf[1]; fracs[s[2]] = buf[2]; fracs[s[3]] = buf[3];
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+void normalizeBatch_avx512(int k, const HIT_INT_TYPE* coordIds, const HIT_INT_TYPE* slots, const double* weights, double* fracs, double* tots) {
+  const __m512d zero = _mm512_setzero_pd();
+  __m512d tot, w;
+  __m512i idx;
+
+  tot = zero;
+  for (int h = 0; h < k; h++) {
+    idx = loadIndices_avx512(coordIds + h * SIMD_BATCH);
+    tot = _mm512_add_pd(tot, _mm512_mask_i64gather_pd(zero, 0xFF, idx, weights, 8));
+  }
+  _mm512_storeu_pd(tots, tot);
+  tot = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(tot, zero, _CMP_LE_OQ), tot, _mm512_set1_pd((double)k));
+
+  for (int h = 0; h < k; h++) {
+    idx = loadIndices_avx512(coordIds + h * SIMD_BATCH);
+    w = _mm512_div_pd(_mm512_mask_i64gather_pd(zero, 0xFF, idx, weights, 8), tot);
+    idx = loadIndices_avx512(slots + h * SIMD_BATCH);
+    _mm512_i64scatter_pd(fracs, idx, w, 8);
+  }
+}
+
+// Most positions hold a single alignment. A block of positions holding one alignment each reads a contiguous
+// range of fracs and is done in vector registers, other blocks fall back to the scalar loop.
+
+__attribute__((target("avx2")))
+double updateValues_avx2(int n, const HIT_INT_TYPE* starts, const double* fracs, const double* base, double* values) {
+  const __m256d signmask = _mm256_set1_pd(-0.0);
+  __m256d value, old, vmax = _mm256_setzero_pd();
+  double buf[4], max_delta;
+  int i;
+
+  max_delta = 0.0;
+  for (i = 0; i + 4 <= n; i += 4) {
+    if (starts[i + 4] - starts[i] != 4) {
+      max_delta = std::max(max_delta, updateValues_scalar(4, starts + i, fracs, base + i, values + i));
+      continue;
+    }
+    // max(-base, frac) keeps frac when they are equal, as the scalar loop does
+    value = _mm256_max_pd(_mm256_xor_pd(_mm256_loadu_pd(base + i), signmask), _mm256_loadu_pd(fracs + starts[i]));
+    old = _mm256_loadu_pd(values + i);
+    vmax = _mm256_max_pd(vmax, _mm256_andnot_pd(signmask, _mm256_sub_pd(old, value)));
+    _mm256_storeu_pd(values + i, value);
+  }
+  if (i < n) max_delta = std::max(max_delta, updateValues_scalar(n - i, starts + i, fracs, base + i, values + i));
+
+  _mm256_storeu_pd(buf, vmax);
+  for (int l = 0; l < 4; l++) max_delta = std::max(max_delta, buf[l]);
+
+  return max_delta;
+}
+
+__attribute__((target("avx512f")))
+double updateValues_avx512(int n, const HIT_INT_TYPE* starts, const double* fracs, const double* base, double* values) {
+  const __m512d zero = _mm512_setzero_pd();
+  __m512d value, old, vmax = zero;
+  double buf[8], max_delta;
+  int i;
+
+  max_delta = 0.0;
+  for (i = 0; i + 8 <= n; i += 8) {
+    if (starts[i + 8] - starts[i] != 8) {
+      max_delta = std::max(max_delta, updateValues_scalar(8, starts + i, fracs, base + i, values + i));
+      continue;
+    }
+    value = _mm512_maskz_max_pd(0xFF, _mm512_sub_pd(zero, _mm512_loadu_pd(base + i)), _mm512_loadu_pd(fracs + starts[i]));
+    old = _mm512_loadu_pd(values + i);
+    vmax = _mm512_maskz_max_pd(0xFF, vmax, _mm512_maskz_max_pd(0xFF, _mm512_sub_pd(old, value), _mm512_sub_pd(value, old)));
+    _mm512_storeu_pd(values + i, value);
+  }
+  if (i < n) max_delta = std::max(max_delta, updateValues_scalar(n - i, starts + i, fracs, base + i, values + i));
+
+  _mm512_storeu_pd(buf, vmax);
+  for (int l = 0; l < 8; l++) max_delta = std::max(max_delta, buf[l]);
+
+  return max_delta;
+}
+
+#endif
+
+#if defined(SIMD_X86) && defined(CSEM_FLOAT)
+
+// gather the SIMD_BATCH floats at base[p[0 .. 7]]
+__attribute__((target("avx2")))
+inline __m256 gather8_avx2(const float* base, const HIT_INT_TYPE* p) {
+#ifdef CSEM64
+  __m128 lo = _mm256_i64gather_ps(base, _mm256_loadu_si256((const __m256i*)p), 4);
+  __m128 hi = _mm256_i64gather_ps(base, _mm256_loadu_si256((const __m256i*)(p + 4)), 4);
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+#else
+  return _mm256_i32gather_ps(base, _mm256_loadu_si256((const __m256i*)p), 4);
+#endif
+}
+
+__attribute__((target("avx2")))
+void normalizeBatch_avx2(int k, const HIT_INT_TYPE* coordIds, const HIT_INT_TYPE* slots, const float* weights, float* fracs, double* tots) {
+  const __m256 zero = _mm256_setzero_ps();
+  __m256 tot, w;
+  float buf[SIMD_BATCH];
+
+  tot = zero;
+  for (int h = 0; h < k; h++) tot = _mm256_add_ps(tot, gather8_avx2(weights, coordIds + h * SIMD_BATCH));
+  _mm256_storeu_ps(buf, tot);
+  for (int l = 0; l < SIMD_BATCH; l++) tots[l] = buf[l];
+  tot = _mm256_blendv_ps(tot, _mm256_set1_ps((float)k), _mm256_cmp_ps(tot, zero, _CMP_LE_OQ));
+
+  for (int h = 0; h < k; h++) {
+    w = _mm256_div_ps(gather8_avx2(weights, coordIds + h * SIMD_BATCH), tot);
+    _mm256_storeu_ps(buf, w);
+    const HIT_INT_TYPE *s = slots + h * SIMD_BATCH;
+    for (int l = 0; l < SIMD_BATCH; l++) fracs[s[l]] = buf[l];
+  }
+}
+
+__attribute__((target("avx2")))
+double updateValues_avx2(int n, const HIT_INT_TYPE* starts, const float* fracs, const float* base, float* values) {
+  const __m256 signmask = _mm256_set1_ps(-0.0f);
+  __m256 value, old, vmax = _mm256_setzero_ps();
+  float buf[8];
+  double max_delta;
+  int i;
+
+  max_delta = 0.0;
+  for (i = 0; i + 8 <= n; i += 8) {
+    if (starts[i + 8] - starts[i] != 8) {
+      max_delta = std::max(max_delta, updateValues_scalar(8, starts + i, fracs, base + i, values + i));
+      continue;
+    }
+    value = _mm256_max_ps(_mm256_xor_ps(_mm256_loadu_ps(base + i), signmask), _mm256_loadu_ps(fracs + starts[i]));
+    old = _mm256_loadu_ps(values + i);
+    vmax = _mm256_max_ps(vmax, _mm256_andnot_ps(signmask, _mm256_sub_ps(old, value)));
+    _mm256_storeu_ps(values + i, value);
+  }
+  if (i < n) max_delta = std::max(max_delta, updateValues_scalar(n - i, starts + i, fracs, base + i, values + i));
+
+  _mm256_storeu_ps(buf, vmax);
+  for (int l = 0; l < 8; l++) max_delta = std::max(max_delta, (double)buf[l]);
+
+  return max_delta;
+}
+
+#endif
+
+inline void simd_normalizeBatch(int k, const HIT_INT_TYPE* coordIds, const HIT_INT_TYPE* slots, const FRAC_TYPE* weights, FRAC_TYPE* fracs, double* tots) {
+#ifdef SIMD_X86
+#ifndef CSEM_FLOAT
+  if (simd_level == SIMD_AVX512) { normalizeBatch_avx512(k, coordIds, slots, weights, fracs, tots); return; }
+#endif
+  if (simd_level == SIMD_AVX2) { normalizeBatch_avx2(k, coordIds, slots, weights, fracs, tots); return; }
+#endif
+  normalizeBatch_scalar(k, coordIds, slots, weights, fracs, tots);
+}
+
+inline double simd_updateValues(int n, const HIT_INT_TYPE* starts, const FRAC_TYPE* fracs, const FRAC_TYPE* base, FRAC_TYPE* values) {
+#ifdef SIMD_X86
+#ifndef CSEM_FLOAT
+  if (simd_level == SIMD_AVX512) return updateValues_avx512(n, starts, fracs, base, values);
+#endif
+  if (simd_level == SIMD_AVX2) return updateValues_avx2(n, starts, fracs, base, values);
+#endif
+  return updateValues_scalar(n, starts, fracs, base, values);
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include<cassert>
+#include<vector>
+#include<algorithm>
+#include<sched.h>
+#include<pthread.h>
+
+#include "my_assert.h"
+
+// A fixed group of worker threads which is created once and reused by every EM round.
+// The calling thread acts as worker 0, so a pool of size 1 never creates a thread.
+// Jobs running inside the pool can call barrier() to hand off from one phase to the next.
+class ThreadPool {
+ public:
+  typedef void* (*JobType)(void*);
+
+  ThreadPool(int);
+  ~ThreadPool();
+
+  int getNumThreads() const { return nThreads; }
+
+  // pin worker i, worker 0 being the calling thread, to cpus[i] and remember the index of its NUMA node, nodes[i]
+  void pin(const std::vector<int>&, const std::vector<int>&);
+
+  bool isPinned() const { return !nodes.empty(); }
+  int getNumNodes() const { return nNodes; }
+  int getNode(int no) const { return nodes[no]; }
+
+  // worker i runs job(args[i]); returns after all workers finish
+  void run(JobType, const std::vector<void*>&);
+
+  // wait until all workers reach this point, must only be called inside a job
+  void barrier();
+
+ private:
+  struct Worker {
+    int no;
+    ThreadPool *pointer;
+
+    Worker(int no, ThreadPool *pointer) { this->no = no; this->pointer = pointer; }
+  };
+
+  int nThreads;
+  std::vector<pthread_t> threads;
+  std::vector<Worker> workers;
+  pthread_attr_t attr;
+  int rc; // only used by the thread owning the pool
+
+  int nNodes;
+  std::vector<int> nodes; // empty unless pinned
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_start, cond_finish;
+
+  JobType job;
+  const std::vector<void*> *args;
+  unsigned long generation; // increased by one for each job
+  int nRunning; // number of workers (excluding worker 0) still running the current job
+  bool quit;
+
+  pthread_mutex_t barrier_mutex;
+  pthread_cond_t barrier_cond;
+  int barrier_count;
+  unsigned long barrier_generation;
+
+  void lock(pthread_mutex_t*);
+  void unlock(pthread_mutex_t*);
+
+  void worker_loop(int);
+
+  static void* worker_loop_wrapper(void* arg) {
+    Worker *worker = (Worker*)arg;
+    worker->pointer->worker_loop(worker->no);
+    return NULL;
+  }
+};
+
+ThreadPool::ThreadPool(int nThreads) : nThreads(nThreads) {
+  general_assert(nThreads > 0, "Number of threads should be at least 1!");
+
+  job = NULL; args = NULL;
+  nNodes = 1; nodes.clear();
+  generation = 0; nRunning = 0; quit = false;
+  barrier_count = 0; barrier_generation = 0;
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond_start, NULL);
+  pthread_cond_init(&cond_finish, NULL);
+  pthread_mutex_init(&barrier_mutex, NULL);
+  pthread_cond_init(&barrier_cond, NULL);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+  workers.clear();
+  for (int i = 0; i < nThreads; i++) workers.push_back(Worker(i, this));
+
+  threads.assign(nThreads, pthread_t());
+  for (int i = 1; i < nThreads; i++) {
+    rc = pthread_create(&threads[i], &attr, worker_loop_wrapper, (void*)(&workers[i]));
+    pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) for the thread pool!");
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  lock(&mutex);
+  quit = true;
+  pthread_cond_broadcast(&cond_start);
+  unlock(&mutex);
+
+  for (int i = 1; i < nThreads; i++) {
+    rc = pthread_join(threads[i], NULL);
+    pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) of the thread pool!");
+  }
+
+  pthread_attr_destroy(&attr);
+  pthread_cond_destroy(&barrier_cond);
+  pthread_mutex_destroy(&barrier_mutex);
+  pthread_cond_destroy(&cond_finish);
+  pthread_cond_destroy(&cond_start);
+  pthread_mutex_destroy(&mutex);
+}
+
+void ThreadPool::run(JobType job, const std::vector<void*>& args) {
+  assert((int)args.size() == nThreads);
+
+  lock(&mutex);
+  this->job = job;
+  this->args = &args;
+  nRunning = nThreads - 1;
+  ++generation;
+  pthread_cond_broadcast(&cond_start);
+  unlock(&mutex);
+
+  job(args[0]);
+
+  lock(&mutex);
+  while (nRunning > 0) pthread_cond_wait(&cond_finish, &mutex);
+  this->job = NULL;
+  this->args = NULL;
+  unlock(&mutex);
+}
+
+void ThreadPool::pin(const std::vector<int>& cpus, const std::vector<int>& nodes) {
+  cpu_set_t set;
+
+  assert((int)cpus.size() == nThreads && (int)nodes.size() == nThreads);
+  for (int i = 0; i < nThreads; i++) {
+    CPU_ZERO(&set);
+    CPU_SET(cpus[i], &set);
+    rc = pthread_setaffinity_np(i == 0 ? pthread_self() : threads[i], sizeof(set), &set);
+    pthread_assert(rc, "pthread_setaffinity_np", "Cannot pin thread " + itos(i) + " (numbered from 0) of the thread pool to CPU " + itos(cpus[i]) + "!");
+  }
+
+  this->nodes = nodes;
+  nNodes = *std::max_element(nodes.begin(), nodes.end()) + 1;
+}
+
+void ThreadPool::barrier() {
+  if (nThreads == 1) return;
+
+  lock(&barrier_mutex);
+  unsigned long my_generation = barrier_generation;
+  if (++barrier_count == nThreads) {
+    barrier_count = 0;
+    ++barrier_generation;
+    pthread_cond_broadcast(&barrier_cond);
+  }
+  else {
+    while (my_generation == barrier_generation) pthread_cond_wait(&barrier_cond, &barrier_mutex);
+  }
+  unlock(&barrier_mutex);
+}
+
+inline void ThreadPool::lock(pthread_mutex_t* m) {
+  int rc = pthread_mutex_lock(m);
+  pthread_assert(rc, "pthread_mutex_lock", "Cannot lock a mutex of the thread pool!");
+}
+
+inline void ThreadPool::unlock(pthread_mutex_t* m) {
+  int rc = pthread_mutex_unlock(m);
+  pthread_assert(rc, "pthread_mutex_unlock", "Cannot unlock a mutex of the thread pool!");
+}
+
+void ThreadPool::worker_loop(int no) {
+  unsigned long seen = 0;
+  JobType my_job;
+  void *my_arg;
+
+  while (true) {
+    lock(&mutex);
+    while (!quit && generation == seen) pthread_cond_wait(&cond_start, &mutex);
+    if (quit) { unlock(&mutex); break; }
+    seen = generation;
+    my_job = job;
+    my_arg = (*args)[no];
+    unlock(&mutex);
+
+    my_job(my_arg);
+
+    lock(&mutex);
+    if (--nRunning == 0) pthread_cond_broadcast(&cond_finish);
+    unlock(&mutex);
+  }
+}
+
+#endif
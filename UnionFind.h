@@ -0,0 +1,38 @@
+#ifndef UNIONFIND_H_
+#define UNIONFIND_H_
+
+#include<cassert>
+#include<vector>
+
+#include "utils.h"
+
+// Disjoint sets over 0 .. n - 1. The smallest member is the root of each set, so roots do not depend on the
+// order of joins.
+class UnionFind {
+ public:
+  UnionFind(HIT_INT_TYPE n) : parent(n) {
+    for (HIT_INT_TYPE i = 0; i < n; i++) parent[i] = i;
+  }
+
+  HIT_INT_TYPE size() const { return parent.size(); }
+
+  void join(HIT_INT_TYPE a, HIT_INT_TYPE b) {
+    a = find(a); b = find(b);
+    if (a < b) parent[b] = a;
+    else parent[a] = b;
+  }
+
+  HIT_INT_TYPE find(HIT_INT_TYPE c) {
+    assert(c < parent.size());
+    while (parent[c] != c) {
+      parent[c] = parent[parent[c]]; // path halving
+      c = parent[c];
+    }
+    return c;
+  }
+
+ private:
+  std::vector<HIT_INT_TYPE> parent;
+};
+
+#endif
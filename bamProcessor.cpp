@@ -13,6 +13,7 @@
 #include "BamAlignment.h"
 #include "SamParser.h"
 #include "BamWriter.h"
+#include "ReadGroupReader.h"
 
 using namespace std;
 
@@ -24,9 +25,10 @@ SamParser *samParser;
 BamWriter *bamWriter;
 FILE *fo;
 
-vector<BamAlignment> alignments;
+ReadGroupReader *reader;
 
 uniform01 *rg;
+vector<double> arr; // reused by every read
 
 // If output format is bam and choice is not to keep original, ZW tag will be removed but the QUAL field is not changed
 void printOut(BamAlignment& b) {
@@ -39,20 +41,23 @@ void printOut(BamAlignment& b) {
 }
 
 void process_a_read() {
-  vector<double> arr;
-  size_t id;
+  ReadGroupReader &alignments = *reader;
+  int id;
 
   switch(choice) {
+  case 0 :
+    for (int i = 0; i < alignments.size(); i++) printOut(alignments[i]);
+    break;
   case 1 : 
     if (alignments.size() == 1) printOut(alignments[0]);
     break;
   case 2 : 
-    arr.assign(alignments.size(), 0.0);
-    for (size_t i = 0; i < alignments.size(); i++) {
+    arr.resize(alignments.size());
+    for (int i = 0; i < alignments.size(); i++) {
       arr[i] = alignments[i].getFrac();
       if (i > 0) arr[i] += arr[i - 1];
     }
-    id = sample(*rg, arr, (int)alignments.size());
+    id = sample(*rg, arr, alignments.size());
     printOut(alignments[id]);
     break;
   default : assert(false);
@@ -60,8 +65,8 @@ void process_a_read() {
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 5) {
-    printf("Usage: csem-bam-processor input.bam output_name <keep orignal bam 0; unique only 1; sampling 2> <bam 0; bed 1; tagAlign 2>\n");
+  if (argc != 5 && argc != 6) {
+    printf("Usage: csem-bam-processor input.bam output_name <keep orignal bam 0; unique only 1; sampling 2> <bam 0; bed 1; tagAlign 2> [number_of_threads]\n");
     exit(-1);
   }
 
@@ -69,13 +74,12 @@ int main(int argc, char* argv[]) {
   assert(choice >= 0 && choice <= 2);
   outputFormat = atoi(argv[4]);
   assert(outputFormat >= 0 && outputFormat <= 2);
+  int nThreads = (argc == 6 ? atoi(argv[5]) : 1);
+  general_assert(nThreads >= 1, "Number of threads should be at least 1!");
 
-  string currentReadName, readName;
-  BamAlignment b;
-
-  HIT_INT_TYPE cnt = 0;
+  uint64_t cnt = 0;
 
-  samParser = new SamParser('b', argv[1]);
+  samParser = new SamParser('b', argv[1], 0, nThreads);
   bamWriter = NULL; fo = NULL;
   rg = NULL;
 
@@ -85,7 +89,7 @@ int main(int argc, char* argv[]) {
   switch(outputFormat) {
   case 0 : 
     sprintf(outF, "%s.bam", argv[2]);
-    bamWriter = new BamWriter(outF, samParser->getHeader());
+    bamWriter = new BamWriter(outF, samParser->getHeader(), nThreads);
     break;
   case 1 :
     sprintf(outF, "%s.bed", argv[2]);
@@ -98,27 +102,17 @@ int main(int argc, char* argv[]) {
   default : assert(false);
   }
 
-  alignments.clear();
-  currentReadName = "";
-
-  while (samParser->next(b)) {
-    ++cnt;
-    if (cnt % 1000000 == 0) printf("%u FIN\n", cnt);
-
-    if (!b.isAligned()) continue;
-
-    if (choice == 0) { printOut(b); continue; }
+  reader = new ReadGroupReader(samParser);
+  while (reader->next()) {
+    process_a_read();
 
-    readName = b.getName();
-    if (currentReadName != readName) {
-      if (currentReadName != "") process_a_read();
-      currentReadName = readName;
-      alignments.clear();
+    while (cnt + 1000000 <= reader->getNumRecords()) {
+      cnt += 1000000;
+      printf("%" PRIu64 " FIN\n", cnt);
     }
-    alignments.push_back(b);
   }
-  if (currentReadName != "") process_a_read();
 
+  delete reader;
   delete samParser;
   if (choice == 2) delete rg;
   if (outputFormat == 0) delete bamWriter;
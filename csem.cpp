@@ -8,7 +8,9 @@
 #include<iostream>
 #include<fstream>
 #include<vector>
+#include<limits>
 #include<algorithm>
+#include<unistd.h>
 #include<pthread.h>
 
 #include "utils.h"
@@ -18,17 +20,40 @@
 #include "BamAlignment.h"
 #include "SamParser.h"
 #include "BamWriter.h"
+#include "ReadGroupReader.h"
 #include "Alignment.h"
 #include "ChromTable.h"
-#include "PThreadWrapper.h"
+#include "ThreadPool.h"
+#include "ChromComponents.h"
+#include "UnionFind.h"
+#include "Checkpoint.h"
+#include "AlignmentCache.h"
+#include "InputSize.h"
+#include "SimdKernels.h"
+#include "Numa.h"
 
 using namespace std;
 
 struct Params {
   int no;
-  vector<READ_INT_TYPE> reads;
+  int chunkBegin, chunkEnd; // read chunks [chunkBegin, chunkEnd), balanced by number of alignments
+  READ_INT_TYPE readBegin, readEnd; // multi-reads [readBegin, readEnd) of these chunks
 
-  Params(int no) { this->no = no; reads.clear(); }
+  int slotChunkBegin, slotChunkEnd; // slot chunks for element-wise operations on fracs
+  HIT_INT_TYPE slotBegin, slotEnd; // and their slot range
+
+  // with SIMD, reads are grouped into batches of SIMD_BATCH reads of the same multiplicity, the rest stay in restReads;
+  // batch b has reads batchReads[b * SIMD_BATCH ...] and alignments [batchStarts[b], batchStarts[b + 1]) interleaved.
+  // Reads are grouped within each chunk, the batches of chunk chunkBegin + k are [chunkBatches[k], chunkBatches[k + 1])
+  // and its other reads restReads[chunkRests[k] .. chunkRests[k + 1] - 1].
+  vector<READ_INT_TYPE> restReads, batchReads;
+  vector<HIT_INT_TYPE> batchStarts, batchSlots, batchCoordIds;
+  vector<size_t> chunkBatches, chunkRests;
+
+  int compChunkBegin, compChunkEnd; // this thread's chunks of compReads while a large component is solved
+  vector<double> prefix; // scratch space for cluster updates
+
+  Params(int no) { this->no = no; chunkBegin = chunkEnd = 0; readBegin = readEnd = 0; slotChunkBegin = slotChunkEnd = 0; slotBegin = slotEnd = 0; compChunkBegin = compChunkEnd = 0; }
 };
 
 bool extendReads;
@@ -36,8 +61,81 @@ bool extendReads;
 int ROUND = 0;
 int UPPERBOUND = 200; // 200 by default
 
+// EM stops once MAX_DELTA <= tolerance and the relative change of the OBJECTIVE <= rel_tolerance. The OBJECTIVE is the sum
+// over multi-reads of the log of their window totals. It is not the likelihood of the model and, unlike the likelihood,
+// it can decrease from one round to the next, so it is only used to judge whether the iterates have settled.
+// The default tolerance is the same for every mode, EM iterates keep changing by rounding errors and rarely reach an
+// exact fixed point. 1e-8 keeps the fractions well within the precision of the float ZW tag.
+#ifdef CSEM_FLOAT
+double tolerance = 1e-6; // single-precision values keep changing by a few ulps, 1e-6 by default
+#else
+double tolerance = 1e-8; // 1e-8 by default
+#endif
+double rel_tolerance = 1e-9; // 1e-9 by default
+
+// SQUAREM acceleration (Varadhan and Roland, Scand J Stat 2008), every EM step counts as one ROUND
+bool squarem;
+vector<FRAC_TYPE> theta0, theta1; // theta1 is overwritten by theta2 once the extrapolation is computed
+double alpha; // step length, always < -1 when extrapolating
+
+// Active-set EM: between full sweeps, a position's value change is only added into the window sums around it
+// when it exceeds active_threshold, and only reads touching changed window sums are normalized again
+bool activeSet;
+double active_threshold;
+const int FULL_SWEEP_INTERVAL = 10; // every 10th round recomputes everything from scratch
+bool activeOnly; // if the next normalization only handles reads whose window sums changed
+vector<double> logTots; // log of each multi-read's window total, so that skipped reads still count in the OBJECTIVE
+// reads with alignments at weights index k are coordReads[coordReadStarts[k] .. coordReadStarts[k + 1] - 1]
+vector<HIT_INT_TYPE> coordReadStarts;
+vector<READ_INT_TYPE> coordReads;
+// built after each ACTIVE update, see buildActiveLists; the next round only touches these reads and positions
+vector<READ_INT_TYPE> activeReads;
+vector<HIT_INT_TYPE> changedCoords, activeCoords;
+vector<size_t> activeChunkStarts; // chunk k normalizes activeReads[activeChunkStarts[k] .. activeChunkStarts[k + 1] - 1]
+vector<int> readStamps, coordStamps; // the ROUND a read or coordinate was last listed in
+
+// Component EM: multi-reads and the clusters of coordinates they touch (see ChromTable::Cluster) fall apart into
+// connected components whose EMs do not interact. Each component is solved on its own and stops once it converges,
+// small ones one per thread and large ones with all threads.
+bool useComponents;
+vector<ChromTable::Cluster> clusters;
+vector<HIT_INT_TYPE> clusterFirsts; // firstCoord of each cluster, to find the cluster of a coordinate
+int nComps;
+vector<HIT_INT_TYPE> compReadStarts, compClusterStarts; // component c has compReads[compReadStarts[c] .. compReadStarts[c + 1] - 1]
+vector<READ_INT_TYPE> compReads;                        // and compClusters[compClusterStarts[c] .. compClusterStarts[c + 1] - 1]
+vector<int> compClusters;
+vector<int> smallComps; // handed out to threads by decreasing size
+int nextSmallComp;
+pthread_mutex_t compLock;
+
+struct CompResult {
+  int rounds;
+  bool converged;
+  double objective, max_delta;
+
+  CompResult() : rounds(0), converged(false), objective(0.0), max_delta(0.0) {}
+};
+vector<CompResult> compResults;
+vector<HIT_INT_TYPE> compChunkStarts; // chunks of compReads of the large component being solved, see componentChunks
+vector<double> compChunkObjectives;
+
 int nThreads = 1; // 1 by default
 
+// Fixed-order reductions: multi-reads and slots are cut into chunks that depend on the input only, never on nThreads.
+// Each chunk's part of the OBJECTIVE or of a SQUAREM norm is summed by one thread in a fixed order and the parts are
+// added up in chunk order, so the EM takes the same path and writes bit-identical output for any number of threads.
+// Threads take contiguous runs of chunks.
+const int MAX_CHUNKS = 1024;
+const HIT_INT_TYPE MIN_CHUNK_SIZE = 4096; // alignments per chunk, or reads per chunk of a component
+int nChunks;
+vector<READ_INT_TYPE> chunkReadStarts; // chunk k has multi-reads [chunkReadStarts[k], chunkReadStarts[k + 1])
+vector<HIT_INT_TYPE> chunkSlotStarts; // slot chunk k has slots [chunkSlotStarts[k], chunkSlotStarts[k + 1])
+vector<double> chunkObjectives, chunkSrs, chunkSvs, chunkResiduals; // parts of the OBJECTIVE and the squared norms for SQUAREM
+
+// NUMA mode: workers are pinned to CPUs node by node, each chromosome's state is first touched on its home node
+// (see ChromTable) and each thread's multi-reads, with their slots and coordIds, are placed on its own node
+bool numa;
+
 int fragment_length, halfws;
 
 CHR_ID_TYPE m; // m chromosomes
@@ -53,173 +151,1207 @@ char inpType;
 char inpF[STRLEN], outName[STRLEN];
 char priorF[STRLEN];
 
-vector<HIT_INT_TYPE> s;
-vector<Alignment> alignments;
+// if set, loadData keeps the raw records in spillF and output reads them back instead of parsing the input again
+char spillF[STRLEN];
+FILE *spill;
+bam_header_t *spillHeader;
+const int SPILL_BUFFER_SIZE = 1 << 22;
+
+// Out-of-core mode: alignments wait on disk in buckets of whole components (see ChromComponents.h) and the buckets
+// are solved one after another, so only one bucket is in memory at a time
+bool outOfCore;
+HIT_INT_TYPE bucketSize; // target number of alignments per bucket
+const int MAX_BUCKETS = 512; // bucket files are open at the same time
+ChromComponents *components;
+int nBuckets;
+
+// one alignment in the temporary files of the out-of-core mode
+struct BucketRecord {
+  CHR_ID_TYPE cid;
+  CHR_LEN_TYPE pos;
+  char dir, isFirst;
+};
+
+// Checkpoints: every checkpointInterval rounds the fractions are saved to outName.ckpt (see Checkpoint.h), which is
+// kept after the run. --resume continues from such a file, possibly with a different UPPERBOUND.
+int checkpointInterval; // 0, no checkpoints
+Checkpoint *checkpoint;
+char resumeF[STRLEN];
+Checkpoint::State resumeState;
+vector<FRAC_TYPE> resumeFracs;
+
+// if set, loadData reads the alignments from this cache (see AlignmentCache.h) instead of parsing the input
+char cacheF[STRLEN];
+
+AlignmentTable alignments;
 
 ChromTable *chromTable;
 
+// EM state, the i-th multi-read's fractions are fracs[slots[ms[i]]] ... fracs[slots[ms[i + 1] - 1]]
+// and the window sums of its alignments are weights[coordIds[ms[i]]] ... weights[coordIds[ms[i + 1] - 1]]
+vector<HIT_INT_TYPE> ms;
+FRAC_TYPE *fracs, *weights;
+const HIT_INT_TYPE *slots, *coordIds;
+
+vector<float> multiFracs; // final fractions of multi-read alignments in input order, filled after EM
+
 // for multi-threading
 vector<Params> paramsArray;
-PThreadWrapper pthreadWrapper;
+vector<void*> paramsPointers;
+ThreadPool *pool;
 
 READ_INT_TYPE nUniqe, nMulti;
 
+#ifndef CSEM64
+// csem keeps 32-bit indices to save memory and hands inputs with more records than they can count over to csem64,
+// which is installed next to it, with the same arguments. The choice is made before anything is loaded.
+char **mainArgv;
+
+void switchTo64Bit(const char* reason) {
+  char path[STRLEN];
+  ssize_t len = readlink("/proc/self/exe", path, STRLEN - 3);
+
+  general_assert(len > 0, "Cannot locate the csem executable!");
+  path[len] = 0;
+  strcat(path, "64");
+
+  fprintf(stderr, "%s, running %s instead!\n", reason, path);
+  fflush(stderr); fflush(stdout);
+  execv(path, mainArgv);
+  general_assert(false, "Cannot run " + cstrtos(path) + "!");
+}
+
+// Records bound both the number of alignments and the number of reads. Caches and checkpoints record the index
+// size of the build that wrote them. Input estimates get a quarter of headroom, as later records may be shorter.
+void chooseIndexWidth() {
+  uint64_t limit = numeric_limits<HIT_INT_TYPE>::max();
+
+  if (resumeF[0] != 0) {
+    if (Checkpoint::getIndexSize(resumeF) > (int)sizeof(HIT_INT_TYPE)) switchTo64Bit("The checkpoint was written with 64-bit indices");
+  }
+  else if (cacheF[0] != 0) {
+    if (AlignmentCache::getIndexSize(cacheF) > (int)sizeof(HIT_INT_TYPE)) switchTo64Bit("The cache was written with 64-bit indices");
+  }
+  else if (maxNumRecords(inpF) > limit && estimateNumRecords(inpType, inpF) / 4 * 5 > limit)
+    switchTo64Bit("The input may have more records than 32-bit indices can count");
+}
+#endif
+
+// called while reading the input, in case chooseIndexWidth underestimated it
+inline void checkCapacity(uint64_t nRecords) {
+#ifdef CSEM64
+  general_assert(nRecords <= numeric_limits<HIT_INT_TYPE>::max(), "The input has more records than 64-bit indices can count!");
+#else
+  general_assert(nRecords <= numeric_limits<HIT_INT_TYPE>::max(), "The input has more records than 32-bit indices can count, please run csem64 instead (run-csem --64)!");
+#endif
+}
+
+void openSpill() {
+  spill = fopen(spillF, "wb");
+  general_assert(spill != NULL, "Cannot write to " + cstrtos(spillF) + "!");
+  setvbuf(spill, NULL, _IOFBF, SPILL_BUFFER_SIZE);
+  spillHeader = bam_header_dwt(samParser->getHeader());
+}
+
+void closeSpill() {
+  general_assert(fclose(spill) == 0, "Fail to write to " + cstrtos(spillF) + "!");
+  spill = NULL;
+}
+
+// csem --build-cache: parse the input once and keep what loadData needs in cacheF
+void buildCache() {
+  AlignmentCache cache;
+  uint64_t cnt = 0;
+
+  samParser = new SamParser(inpType, inpF, 0, nThreads);
+  ReadGroupReader reader(samParser);
+
+  n = 0;
+  while (reader.next()) {
+    checkCapacity(reader.getNumRecords());
+    ++n;
+    for (int i = 0; i < reader.size(); i++) cache.add(reader[i], i == 0);
+
+    while (cnt + 1000000 <= reader.getNumRecords()) {
+      cnt += 1000000;
+      fprintf(stderr, "%" PRIu64 " FIN\n", cnt);
+    }
+  }
+
+  m = samParser->getHeader()->n_targets;
+  delete samParser;
+
+  cache.write(cacheF, n, m, reader.getNumRecords(), inpF);
+
+  fprintf(stderr, "Alignment cache %s is built!\n", cacheF);
+}
+
+void loadCache() {
+  AlignmentCache cache;
+
+  samParser = new SamParser(inpType, inpF, 0, 1);
+  chrMap = new ChrMap(samParser->getHeader());
+  delete samParser;
+  m = chrMap->size();
+
+  cache.open(cacheF, m, inpF);
+  n = cache.getNumReads();
+  nAmts = cache.size();
+
+  alignments.clear();
+  alignments.reserve(nAmts);
+  for (HIT_INT_TYPE i = 0; i < nAmts; i++)
+    alignments.push_back(cache.getCid(i), (extendReads ? cache.getMidPos(i, fragment_length) : cache.getPos(i)), cache.getDir(i), cache.isFirst(i)); // extend reads or not
+
+  fprintf(stderr, "Loading data from %s is finished!\n", cacheF);
+}
+
 void loadData() {
-  string currentReadName, readName;
-  BamAlignment b;
+  uint64_t cnt = 0;
 
-  HIT_INT_TYPE cnt = 0;
+  if (cacheF[0] != 0) { loadCache(); return; }
 
-  samParser = new SamParser(inpType, inpF);
+  samParser = new SamParser(inpType, inpF, 0, nThreads);
+  if (spillF[0] != 0) openSpill();
 
-  s.clear();
+  ReadGroupReader reader(samParser, spill);
+
+  n = 0;
   alignments.clear();
-  currentReadName = "";
-  while (samParser->next(b)) {
-    ++cnt;
-    if (cnt % 1000000 == 0) fprintf(stderr, "%u FIN\n", cnt);
-
-    if (!b.isAligned()) continue;
-    readName = b.getName();
-    if (currentReadName != readName) {
-      // push the start position into s
-      s.push_back(alignments.size());
-      currentReadName = readName;
+  while (reader.next()) {
+    checkCapacity(reader.getNumRecords());
+    ++n;
+    for (int i = 0; i < reader.size(); i++) {
+      BamAlignment &b = reader[i];
+      alignments.push_back(b.getCid(), (extendReads? b.getMidPos(fragment_length) : b.getPos()), b.getDir(), i == 0);  // extend reads or not
+    }
+
+    while (cnt + 1000000 <= reader.getNumRecords()) {
+      cnt += 1000000;
+      fprintf(stderr, "%" PRIu64 " FIN\n", cnt);
     }
-    alignments.push_back(Alignment(b.getCid(), (extendReads? b.getMidPos(fragment_length) : b.getPos()), b.getDir()));  // extend reads or not
   }
 
   chrMap = new ChrMap(samParser->getHeader());
   
   m = chrMap->size();
-  n = s.size(); 
   nAmts = alignments.size();
-  s.push_back(nAmts);
 
   delete samParser;
+  if (spill != NULL) closeSpill();
 
   fprintf(stderr, "Loading data is finished!\n");
 }
 
-void splitJobs_and_Init() {
-  int cur_thread;
-  double tot;
-  CHR_LEN_TYPE lb, ub;
+// take the alignments and fractions from a checkpoint instead of the input file, only its header is read
+void loadCheckpoint() {
+  Checkpoint ckpt;
 
-  cur_thread = 0;
-  paramsArray.clear();
-  for (READ_INT_TYPE i = 0; i < n; i++) {
-    if (s[i + 1] - s[i] == 1) { alignments[s[i]].frac = 1.0; continue; }
+  ckpt.open(resumeF, fragment_length, extendReads, inpF, priorF);
 
-    // initialization, for each multi-read, distribute it uniformly
-    tot = 0.0;
-    for (HIT_INT_TYPE j = s[i]; j < s[i + 1]; j++) {
-      lb = max(-1, alignments[j].pos - halfws - 1);
-      ub = min(chrMap->getLen(alignments[j].cid) - 1, alignments[j].pos + halfws);
-      alignments[j].frac = ub - lb;
-      tot += alignments[j].frac;
+  samParser = new SamParser(inpType, inpF, 0, 1);
+  chrMap = new ChrMap(samParser->getHeader());
+  delete samParser;
+
+  m = chrMap->size();
+  general_assert(m == ckpt.getNumChroms(), cstrtos(resumeF) + " was made from an input with different chromosomes!");
+
+  n = ckpt.getNumReads();
+  ckpt.loadAlignments(alignments);
+  nAmts = alignments.size();
+
+  resumeState = ckpt.getState();
+  resumeFracs.assign(ckpt.getFracs(), ckpt.getFracs() + ckpt.getNumSlots());
+
+  fprintf(stderr, "Checkpoint of ROUND %d is loaded from %s!\n", resumeState.round, resumeF);
+}
+
+void bucketFileName(char* fileName, const char* kind, int bucket) {
+  general_assert(snprintf(fileName, STRLEN, "%s.%s_%d", outName, kind, bucket) < STRLEN, "The name of bucket file " + itos(bucket) + " is too long!");
+}
+
+// Out-of-core loading: the alignments are written to a temporary file while the components are found, then the
+// alignments of components with multi-reads are routed to their bucket files. Other alignments all get 1.0.
+void loadBuckets() {
+  char readsF[STRLEN], fileName[STRLEN];
+  FILE *fo, *fi;
+  vector<FILE*> bucketFs;
+  BucketRecord rec;
+  uint64_t cnt = 0;
+  HIT_INT_TYPE total = 0;
+
+  samParser = new SamParser(inpType, inpF, 0, nThreads);
+  if (spillF[0] != 0) openSpill();
+
+  chrMap = new ChrMap(samParser->getHeader());
+  m = chrMap->size();
+  components = new ChromComponents(m);
+
+  general_assert(snprintf(readsF, STRLEN, "%s.reads", outName) < STRLEN, "The name of the temporary reads file is too long!");
+  fo = fopen(readsF, "wb");
+  general_assert(fo != NULL, "Cannot write to " + cstrtos(readsF) + "!");
+  setvbuf(fo, NULL, _IOFBF, SPILL_BUFFER_SIZE);
+
+  ReadGroupReader reader(samParser, spill);
+
+  n = 0;
+  memset(&rec, 0, sizeof(rec));
+  while (reader.next()) {
+    checkCapacity(reader.getNumRecords());
+    ++n;
+    for (int i = 0; i < reader.size(); i++) {
+      BamAlignment &b = reader[i];
+      rec.cid = b.getCid();
+      rec.pos = (extendReads? b.getMidPos(fragment_length) : b.getPos());
+      rec.dir = b.getDir();
+      rec.isFirst = (i == 0);
+      general_assert(fwrite(&rec, sizeof(rec), 1, fo) == 1, "Fail to write to " + cstrtos(readsF) + "!");
+
+      components->addAlignments(rec.cid, 1, reader.size() > 1);
+      if (i > 0) components->join(reader[0].getCid(), rec.cid);
     }
+    total += reader.size();
 
-    for (HIT_INT_TYPE j = s[i]; j < s[i + 1]; j++) {
-      alignments[j].frac /= tot;
-      alignments[j].isMulti = true;
+    while (cnt + 1000000 <= reader.getNumRecords()) {
+      cnt += 1000000;
+      fprintf(stderr, "%" PRIu64 " FIN\n", cnt);
     }
+  }
+
+  delete samParser;
+  if (spill != NULL) closeSpill();
+  general_assert(fclose(fo) == 0, "Fail to write to " + cstrtos(readsF) + "!");
+
+  nBuckets = components->buildBuckets(bucketSize, MAX_BUCKETS);
+  fprintf(stderr, "%" PRIu64 " reads with %" PRIu64 " alignments, alignments of multi-read components are split into %d buckets of about %" PRIu64 " alignments!\n", (uint64_t)n, (uint64_t)total, nBuckets, (uint64_t)bucketSize);
+
+  bucketFs.assign(nBuckets, NULL);
+  for (int i = 0; i < nBuckets; i++) {
+    bucketFileName(fileName, "bucket", i);
+    bucketFs[i] = fopen(fileName, "wb");
+    general_assert(bucketFs[i] != NULL, "Cannot write to " + cstrtos(fileName) + "!");
+  }
+
+  // all alignments of a read lie in one component
+  fi = fopen(readsF, "rb");
+  general_assert(fi != NULL, "Cannot open " + cstrtos(readsF) + "!");
+  setvbuf(fi, NULL, _IOFBF, SPILL_BUFFER_SIZE);
+  while (fread(&rec, sizeof(rec), 1, fi) == 1) {
+    int bucket = components->getBucket(rec.cid);
+    if (bucket >= 0) general_assert(fwrite(&rec, sizeof(rec), 1, bucketFs[bucket]) == 1, "Fail to write bucket " + itos(bucket) + "!");
+  }
+  fclose(fi);
+  remove(readsF);
+
+  for (int i = 0; i < nBuckets; i++) general_assert(fclose(bucketFs[i]) == 0, "Fail to write bucket " + itos(i) + "!");
+
+  fprintf(stderr, "Loading data is finished!\n");
+}
+
+// bring one bucket into alignments, its file is removed afterwards
+void loadBucket(int bucket) {
+  char fileName[STRLEN];
+  FILE *fi;
+  BucketRecord rec;
+
+  bucketFileName(fileName, "bucket", bucket);
+  fi = fopen(fileName, "rb");
+  general_assert(fi != NULL, "Cannot open " + cstrtos(fileName) + "!");
+  setvbuf(fi, NULL, _IOFBF, SPILL_BUFFER_SIZE);
+
+  n = 0;
+  alignments.clear();
+  while (fread(&rec, sizeof(rec), 1, fi) == 1) {
+    if (rec.isFirst) ++n;
+    alignments.push_back(rec.cid, rec.pos, rec.dir, rec.isFirst);
+  }
+  nAmts = alignments.size();
+
+  fclose(fi);
+  remove(fileName);
+}
+
+// fractions of all alignments of a bucket in input order
+void saveBucketFracs(int bucket) {
+  char fileName[STRLEN];
+  FILE *fo;
+  float frac;
+  HIT_INT_TYPE q = 0;
+
+  bucketFileName(fileName, "fracs", bucket);
+  fo = fopen(fileName, "wb");
+  general_assert(fo != NULL, "Cannot write to " + cstrtos(fileName) + "!");
+  for (HIT_INT_TYPE i = 0; i < nAmts; i++) {
+    frac = (alignments.isMulti(i) ? multiFracs[q++] : 1.0);
+    general_assert(fwrite(&frac, sizeof(float), 1, fo) == 1, "Fail to write to " + cstrtos(fileName) + "!");
+  }
+  general_assert(fclose(fo) == 0, "Fail to write to " + cstrtos(fileName) + "!");
+}
 
-    // assigning reads to threads
-    if (pthreadWrapper.num_threads_used < nThreads) { 
-      paramsArray.push_back(Params(pthreadWrapper.num_threads_used));
-      ++pthreadWrapper.num_threads_used;
+// the parts in chunk order, which is the same for any number of threads
+double sumChunks(const vector<double>& parts) {
+  double sum = 0.0;
+  for (size_t i = 0; i < parts.size(); i++) sum += parts[i];
+  return sum;
+}
+
+// number of chunks of size items, chunks are at least MIN_CHUNK_SIZE large unless there is only one
+int numChunks(HIT_INT_TYPE size) {
+  return (int)min((HIT_INT_TYPE)MAX_CHUNKS, max((HIT_INT_TYPE)1, size / MIN_CHUNK_SIZE));
+}
+
+void normalize(Params*);
+void normalizeFracs(Params*);
+
+// group the reads of each of this thread's chunks into batches for the SIMD kernels
+void* buildBatches_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  vector<pair<HIT_INT_TYPE, READ_INT_TYPE> > order;
+  size_t i, j, nb;
+
+  params->restReads.clear(); params->batchReads.clear();
+  params->batchStarts.assign(1, 0); params->batchSlots.clear(); params->batchCoordIds.clear();
+  params->chunkBatches.assign(1, 0); params->chunkRests.assign(1, 0);
+  for (int c = params->chunkBegin; c < params->chunkEnd; c++) {
+    order.clear();
+    for (READ_INT_TYPE rid = chunkReadStarts[c]; rid < chunkReadStarts[c + 1]; rid++) order.push_back(make_pair(ms[rid + 1] - ms[rid], rid));
+    sort(order.begin(), order.end());
+
+    for (i = 0; i < order.size(); i = j) {
+      HIT_INT_TYPE k = order[i].first;
+      for (j = i; j < order.size() && order[j].first == k; j++) ;
+      nb = (j - i) / SIMD_BATCH;
+      for (size_t b = 0; b < nb; b++) {
+	size_t first = i + b * SIMD_BATCH;
+	for (int l = 0; l < SIMD_BATCH; l++) params->batchReads.push_back(order[first + l].second);
+	for (HIT_INT_TYPE h = 0; h < k; h++)
+	  for (int l = 0; l < SIMD_BATCH; l++) {
+	    HIT_INT_TYPE p = ms[order[first + l].second] + h;
+	    params->batchSlots.push_back(slots[p]);
+	    params->batchCoordIds.push_back(coordIds[p]);
+	  }
+	params->batchStarts.push_back(params->batchSlots.size());
+      }
+      for (size_t r = i + nb * SIMD_BATCH; r < j; r++) params->restReads.push_back(order[r].second);
     }
-    paramsArray[cur_thread].reads.push_back(i);
-    ++cur_thread; if (cur_thread == nThreads) cur_thread = 0;
+    params->chunkBatches.push_back(params->batchStarts.size() - 1);
+    params->chunkRests.push_back(params->restReads.size());
+  }
+
+  return NULL;
+}
+
+void* normalize_per_thread(void* arg) {
+  normalize((Params*)arg);
+  return NULL;
+}
+
+void pinThreads() {
+  NumaTopology topology;
+  vector<int> cpuOf, nodeOf;
+
+  topology.placeThreads(nThreads, cpuOf, nodeOf);
+  pool->pin(cpuOf, nodeOf);
+
+  fprintf(stderr, "%d threads are pinned to CPUs of %d NUMA nodes:", nThreads, pool->getNumNodes());
+  for (int i = 0; i < nThreads; i++) fprintf(stderr, " %d(node %d)", cpuOf[i], topology.getNodeId(nodeOf[i]));
+  fprintf(stderr, "\n");
+}
+
+// the multi-reads of each thread, their entries of ms, slots and coordIds, move to pages of that thread's node
+void placeReadShards() {
+  vector<size_t> readBounds(nThreads + 1, 0), slotBounds(nThreads + 1, 0);
+
+  for (int i = 0; i < nThreads; i++) {
+    readBounds[i] = paramsArray[i].readBegin;
+    slotBounds[i] = ms[paramsArray[i].readBegin];
+  }
+  readBounds[nThreads] = nMulti + 1; // the last thread also keeps the end of ms
+  slotBounds[nThreads] = ms[nMulti];
+
+  placeByThreads(pool, ms, readBounds);
+  chromTable->placeSlots(slotBounds);
+}
+
+// the reverse of coordIds, from weights indices to the multi-reads aligned there
+void buildCoordReads() {
+  HIT_INT_TYPE nCoords = chromTable->getWeights().size();
+  vector<HIT_INT_TYPE> next;
+
+  coordReadStarts.assign(nCoords + 1, 0);
+  for (HIT_INT_TYPE j = 0; j < ms[nMulti]; j++) ++coordReadStarts[coordIds[j] + 1];
+  for (HIT_INT_TYPE k = 0; k < nCoords; k++) coordReadStarts[k + 1] += coordReadStarts[k];
+
+  next.assign(coordReadStarts.begin(), coordReadStarts.end() - 1);
+  coordReads.assign(ms[nMulti], 0);
+  for (READ_INT_TYPE rid = 0; rid < nMulti; rid++)
+    for (HIT_INT_TYPE j = ms[rid]; j < ms[rid + 1]; j++) coordReads[next[coordIds[j]]++] = rid;
+
+  readStamps.assign(nMulti, 0);
+  coordStamps.assign(nCoords, 0);
+}
+
+void splitJobs_and_Init() {
+  HIT_INT_TYPE start, end;
+
+  paramsArray.clear();
+  for (int i = 0; i < nThreads; i++) paramsArray.push_back(Params(i));
+  ms.clear();
+  ms.push_back(0);
+  for (start = 0; start < nAmts; start = end) {
+    end = start + 1;
+    while (end < nAmts && !alignments.isFirst(end)) ++end;
+    if (end - start == 1) continue;
+
+    for (HIT_INT_TYPE j = start; j < end; j++) alignments.setMulti(j);
+    ms.push_back(ms.back() + (end - start));
+  }
+  nMulti = ms.size() - 1;
+  nUniqe = n - nMulti;
+
+  // cutting reads into chunks, chunk k starts at the first read whose alignments begin at or after k / nChunks of all;
+  // slot chunk k starts at k / nChunks of all slots
+  nChunks = numChunks(ms[nMulti]);
+  chunkReadStarts.assign(nChunks + 1, nMulti);
+  chunkSlotStarts.assign(nChunks + 1, ms[nMulti]);
+  for (int k = 0; k < nChunks; k++) {
+    chunkSlotStarts[k] = (HIT_INT_TYPE)((double)ms[nMulti] * k / nChunks);
+    chunkReadStarts[k] = lower_bound(ms.begin(), ms.end() - 1, chunkSlotStarts[k]) - ms.begin();
   }
+  chunkObjectives.assign(nChunks, 0.0);
+  chunkSrs.assign(nChunks, 0.0); chunkSvs.assign(nChunks, 0.0); chunkResiduals.assign(nChunks, 0.0);
 
-  pthreadWrapper.threads.assign(pthreadWrapper.num_threads_used, pthread_t());
+  // assigning chunks to threads, thread i starts at the first chunk whose alignments begin at or after i / nThreads of all
+  int chunk = 0;
+  for (int i = 0; i < nThreads; i++) {
+    HIT_INT_TYPE target = (HIT_INT_TYPE)((double)ms[nMulti] * i / nThreads);
+    while (chunk < nChunks && ms[chunkReadStarts[chunk]] < target) ++chunk;
+    paramsArray[i].chunkBegin = chunk;
+    if (i > 0) paramsArray[i - 1].chunkEnd = chunk;
+  }
+  paramsArray[nThreads - 1].chunkEnd = nChunks;
+
+  paramsPointers.clear();
+  for (int i = 0; i < nThreads; i++) {
+    Params& params = paramsArray[i];
+    params.readBegin = chunkReadStarts[params.chunkBegin];
+    params.readEnd = chunkReadStarts[params.chunkEnd];
+    params.slotChunkBegin = (int)((int64_t)nChunks * i / nThreads);
+    params.slotChunkEnd = (int)((int64_t)nChunks * (i + 1) / nThreads);
+    params.slotBegin = chunkSlotStarts[params.slotChunkBegin];
+    params.slotEnd = chunkSlotStarts[params.slotChunkEnd];
+    paramsPointers.push_back((void*)(&params));
+  }
+
+  pool = new ThreadPool(nThreads);
+  if (numa) pinThreads();
+  chromTable = new ChromTable(chrMap, alignments, halfws, pool, priorF);
+  if (numa) placeReadShards();
+  fracs = (nMulti > 0 ? &(chromTable->getFracs()[0]) : NULL);
+  weights = (nMulti > 0 ? &(chromTable->getWeights()[0]) : NULL);
+  slots = (nMulti > 0 ? &(chromTable->getSlots()[0]) : NULL);
+  coordIds = (nMulti > 0 ? &(chromTable->getCoordIds()[0]) : NULL);
+  chromTable->setActiveThreshold(active_threshold);
+  if (checkpointInterval > 0) {
+    char ckptF[STRLEN];
+    general_assert(snprintf(ckptF, STRLEN, "%s.ckpt", outName) < STRLEN, "The name of the checkpoint file is too long!");
+    checkpoint = new Checkpoint();
+    checkpoint->create(ckptF, alignments, n, m, fragment_length, extendReads, ms[nMulti], inpF, priorF);
+  }
+  alignments.releaseCoordinates();
+  if (simd_level != SIMD_SCALAR) pool->run(buildBatches_per_thread, paramsPointers);
+
+  // initialization, for each multi-read, distribute it uniformly
+  activeOnly = false;
+  if (activeSet) {
+    logTots.assign(nMulti, 0.0);
+    if (numa) releasePages(logTots);
+    buildCoordReads();
+  }
+  pool->run(normalize_per_thread, paramsPointers);
 
-  chromTable = new ChromTable(chrMap, alignments, halfws, nThreads, priorF);
   fprintf(stderr, "Splitting jobs and initialization are finished!\n");
 }
 
-void* allocateMultiReads_per_thread(void* arg) {
-  Params *params = (Params*)arg;
-  double tot;
+// fracs of read rid are set proportional to the window sums of its alignments, returns the log of its window total
+inline double normalizeRead(READ_INT_TYPE rid) {
+  FRAC_TYPE tot;
+  double logtot;
+  HIT_INT_TYPE j;
 
-  for (size_t i = 0; i < params->reads.size(); i++) {
-    READ_INT_TYPE rid = params->reads[i];
+  tot = 0.0;
+  for (j = ms[rid]; j < ms[rid + 1]; j++) tot += weights[coordIds[j]];
 
-    tot = 0.0;
-    for (HIT_INT_TYPE j = s[rid]; j < s[rid + 1]; j++) {
-      assert(alignments[j].frac >= 0.0);
-      tot += alignments[j].frac;
+  if (tot <= 0.0) { tot = ms[rid + 1] - ms[rid]; logtot = 0.0; } // if adding prior leads to all fracs be 0, allocate the read uniformly
+  else logtot = log((double)tot);
+  if (activeSet) logTots[rid] = logtot;
+
+  for (j = ms[rid]; j < ms[rid + 1]; j++) 
+    fracs[slots[j]] = weights[coordIds[j]] / tot;
+
+  return logtot;
+}
+
+// normalize the reads of this thread's chunks, each chunk's part of the OBJECTIVE goes to chunkObjectives
+void normalize(Params* params) {
+  double tots[SIMD_BATCH], logtot, objective;
+  HIT_INT_TYPE start, end;
+
+  for (int c = params->chunkBegin; c < params->chunkEnd; c++) {
+    int k = c - params->chunkBegin;
+
+    objective = 0.0;
+    // active rounds only touch the listed reads, the others keep their part of the OBJECTIVE
+    if (activeOnly) {
+      objective = chunkObjectives[c];
+      for (size_t i = activeChunkStarts[c]; i < activeChunkStarts[c + 1]; i++) {
+	READ_INT_TYPE rid = activeReads[i];
+	objective -= logTots[rid];
+	objective += normalizeRead(rid);
+      }
+    }
+    else if (simd_level == SIMD_SCALAR) {
+      for (READ_INT_TYPE rid = chunkReadStarts[c]; rid < chunkReadStarts[c + 1]; rid++) objective += normalizeRead(rid);
+    }
+    else {
+      for (size_t b = params->chunkBatches[k]; b < params->chunkBatches[k + 1]; b++) {
+	start = params->batchStarts[b]; end = params->batchStarts[b + 1];
+	simd_normalizeBatch((end - start) / SIMD_BATCH, &params->batchCoordIds[start], &params->batchSlots[start], weights, fracs, tots);
+	for (int l = 0; l < SIMD_BATCH; l++) {
+	  logtot = (tots[l] > 0.0 ? log(tots[l]) : 0.0);
+	  objective += logtot;
+	  if (activeSet) logTots[params->batchReads[b * SIMD_BATCH + l]] = logtot;
+	}
+      }
+      for (size_t i = params->chunkRests[k]; i < params->chunkRests[k + 1]; i++) objective += normalizeRead(params->restReads[i]);
     }
+    chunkObjectives[c] = objective;
+  }
+}
+
+// fracs of each read are rescaled to sum to 1
+void normalizeFracs(Params* params) {
+  double tot;
 
-    if (tot <= 0.0) tot = s[rid + 1] - s[rid]; // if adding prior leads to all fracs be 0, allocate the read uniformly
+  for (READ_INT_TYPE rid = params->readBegin; rid < params->readEnd; rid++) {
+    tot = 0.0;
+    for (HIT_INT_TYPE j = ms[rid]; j < ms[rid + 1]; j++) tot += fracs[slots[j]];
+    if (tot <= 0.0) continue;
 
-    for (HIT_INT_TYPE j = s[rid]; j < s[rid + 1]; j++) 
-      alignments[j].frac /= tot;
-  
+    for (HIT_INT_TYPE j = ms[rid]; j < ms[rid + 1]; j++) 
+      fracs[slots[j]] /= tot;
   }
+}
+
+void* allocateMultiReads_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+
+  normalize(params);
+
+  // all reads must be normalized before any chromosome is updated
+  pool->barrier();
+  chromTable->update_per_thread(params->no);
 
   return NULL;
 }
 
+inline bool hasConverged(int round, double max_delta, double objective, double prev_objective) {
+  return round > 1 && max_delta <= tolerance && fabs(objective - prev_objective) <= rel_tolerance * fabs(prev_objective);
+}
+
+// List the reads touching window sums changed by the last ACTIVE update, which the next round normalizes, and the
+// weights indices of their alignments, the only values the next ACTIVE update has to recompute. Both lists are
+// sorted, so that chunks add up their reads in the same order as in full rounds.
+void buildActiveLists() {
+  HIT_INT_TYPE k;
+  READ_INT_TYPE rid;
+
+  changedCoords.clear(); activeReads.clear(); activeCoords.clear();
+  chromTable->getChangedCoords(changedCoords);
+  for (size_t i = 0; i < changedCoords.size(); i++) {
+    k = changedCoords[i];
+    for (HIT_INT_TYPE l = coordReadStarts[k]; l < coordReadStarts[k + 1]; l++) {
+      rid = coordReads[l];
+      if (readStamps[rid] == ROUND) continue;
+      readStamps[rid] = ROUND;
+      activeReads.push_back(rid);
+    }
+  }
+  sort(activeReads.begin(), activeReads.end());
+
+  for (size_t i = 0; i < activeReads.size(); i++) {
+    rid = activeReads[i];
+    for (HIT_INT_TYPE j = ms[rid]; j < ms[rid + 1]; j++) {
+      k = coordIds[j];
+      if (coordStamps[k] == ROUND) continue;
+      coordStamps[k] = ROUND;
+      activeCoords.push_back(k);
+    }
+  }
+  sort(activeCoords.begin(), activeCoords.end());
+
+  activeChunkStarts.assign(nChunks + 1, 0);
+  for (int c = 0; c <= nChunks; c++)
+    activeChunkStarts[c] = lower_bound(activeReads.begin(), activeReads.end(), chunkReadStarts[c]) - activeReads.begin();
+}
+
 void allocateMultiReads() {
+  bool converged, lastRound;
+  double objective, prev_objective;
+  int firstRound;
+  ChromTable::UpdateType updateType;
+
+  converged = false;
+  objective = prev_objective = 0.0;
+  firstRound = 1;
+  if (resumeF[0] != 0) {
+    general_assert(resumeFracs.size() == ms[nMulti], cstrtos(resumeF) + " does not match the alignments!");
+    for (HIT_INT_TYPE i = 0; i < ms[nMulti]; i++) fracs[i] = resumeFracs[i];
+    vector<FRAC_TYPE>().swap(resumeFracs);
+    converged = resumeState.converged;
+    objective = prev_objective = resumeState.objective;
+    firstRound = resumeState.round + 1;
+    // fractions after the saved round are final if it reached the upper bound
+    if (firstRound > UPPERBOUND) fprintf(stderr, "The checkpoint is already at ROUND %d, no EM rounds are run!\n", resumeState.round);
+  }
+
   // update chromTable
-  chromTable->update(UPPERBOUND > 0);
-
-  for (ROUND = 1; ROUND <= UPPERBOUND; ROUND++) {
-    // allocate muti-reads    
-    // create threads
-    for (int i = 0; i < pthreadWrapper.num_threads_used; i++) {
-      pthreadWrapper.rc = pthread_create(&pthreadWrapper.threads[i], &pthreadWrapper.attr, allocateMultiReads_per_thread, (void*)(&paramsArray[i]));
-      pthread_assert(pthreadWrapper.rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) at ROUND " + itos(ROUND) + "!");
+  chromTable->update(UPPERBOUND > 0 ? ChromTable::FULL : ChromTable::VALUES_ONLY);
+
+  activeOnly = false;
+  for (ROUND = firstRound; ROUND <= UPPERBOUND; ROUND++) {
+    // once converged, one more round is needed to turn window sums into fractions
+    lastRound = converged || ROUND == UPPERBOUND;
+
+    if (lastRound) { updateType = ChromTable::VALUES_ONLY; activeOnly = false; }
+    // once no change is large enough to propagate, active rounds would idle until the next full sweep
+    else if (!activeSet || ROUND % FULL_SWEEP_INTERVAL == 0 || (activeOnly && activeReads.empty())) updateType = ChromTable::FULL;
+    else updateType = ChromTable::ACTIVE;
+
+    // allocate muti-reads and then update chromTable, both phases run in the same pool job
+    chromTable->setActiveCoords(activeOnly ? &activeCoords : NULL);
+    chromTable->prepareUpdate(updateType);
+    pool->run(allocateMultiReads_per_thread, paramsPointers);
+    chromTable->finishUpdate();
+    activeOnly = (updateType == ChromTable::ACTIVE);
+    if (activeOnly) buildActiveLists();
+
+    objective = sumChunks(chunkObjectives);
+
+    fprintf(stderr, "ROUND = %d, MAX_DELTA = %.6g, OBJECTIVE = %.10g\n", ROUND, chromTable->getMaxDelta(), objective);
+
+    if (lastRound) break;
+
+    converged = hasConverged(ROUND, chromTable->getMaxDelta(), objective, prev_objective);
+    prev_objective = objective;
+
+    if (checkpointInterval > 0 && ROUND % checkpointInterval == 0) checkpoint->save(ROUND, converged, objective, fracs);
+  }
+
+  // the final state too, for warm starts with a larger UPPERBOUND
+  if (checkpointInterval > 0 && firstRound <= UPPERBOUND) checkpoint->save(ROUND, converged, objective, fracs);
+
+  if (UPPERBOUND > 0 && firstRound <= UPPERBOUND) fprintf(stderr, "EM %s after %d rounds, MAX_DELTA = %.6g\n", (converged ? "converged" : "reached the upper bound"), ROUND, chromTable->getMaxDelta());
+}
+
+// one EM step on normalized fracs: update chromTable and then normalize, the reverse of allocateMultiReads_per_thread
+void* emStep_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+
+  chromTable->update_per_thread(params->no);
+  pool->barrier();
+  normalize(params);
+
+  return NULL;
+}
+
+void* saveTheta0_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  for (HIT_INT_TYPE i = params->slotBegin; i < params->slotEnd; i++) theta0[i] = fracs[i];
+  return NULL;
+}
+
+void* saveTheta1_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  for (HIT_INT_TYPE i = params->slotBegin; i < params->slotEnd; i++) theta1[i] = fracs[i];
+  return NULL;
+}
+
+// r = theta1 - theta0, v = theta2 - 2 * theta1 + theta0, theta2 is in fracs; chunkResiduals gets theta2 - theta1,
+// the residual of the EM step from theta1
+void* squaremNorms_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  double r, v, d, sr, sv, sd;
+
+  for (int c = params->slotChunkBegin; c < params->slotChunkEnd; c++) {
+    sr = sv = sd = 0.0;
+    for (HIT_INT_TYPE i = chunkSlotStarts[c]; i < chunkSlotStarts[c + 1]; i++) {
+      r = theta1[i] - theta0[i];
+      d = fracs[i] - theta1[i];
+      v = d - r;
+      sr += r * r;
+      sv += v * v;
+      sd += d * d;
     }
-    // join threads
-    for (int i = 0; i < pthreadWrapper.num_threads_used; i++) {
-      pthreadWrapper.rc = pthread_join(pthreadWrapper.threads[i], NULL);
-      pthread_assert(pthreadWrapper.rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) at ROUND " + itos(ROUND) + "!");
+    chunkSrs[c] = sr; chunkSvs[c] = sv; chunkResiduals[c] = sd;
+  }
+
+  return NULL;
+}
+
+// fracs = theta0 - 2 * alpha * r + alpha^2 * v projected back onto the simplex of each read, theta2 is kept in theta1
+// and the extrapolated point in theta0
+void* squaremExtrapolate_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  double r, v, value;
+
+  for (HIT_INT_TYPE i = params->slotBegin; i < params->slotEnd; i++) {
+    r = theta1[i] - theta0[i];
+    v = fracs[i] - theta1[i] - r;
+    value = theta0[i] - 2.0 * alpha * r + alpha * alpha * v;
+    theta1[i] = fracs[i];
+    fracs[i] = (value > 0.0 ? value : 0.0);
+  }
+
+  // slots and reads are partitioned differently
+  pool->barrier();
+  normalizeFracs(params);
+  pool->barrier();
+  for (HIT_INT_TYPE i = params->slotBegin; i < params->slotEnd; i++) theta0[i] = fracs[i];
+
+  return NULL;
+}
+
+// chunkResiduals gets the residual of the EM step from the extrapolated point in theta0 to fracs
+void* squaremResidual_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  double d, sd;
+
+  for (int c = params->slotChunkBegin; c < params->slotChunkEnd; c++) {
+    sd = 0.0;
+    for (HIT_INT_TYPE i = chunkSlotStarts[c]; i < chunkSlotStarts[c + 1]; i++) {
+      d = fracs[i] - theta0[i];
+      sd += d * d;
     }
+    chunkResiduals[c] = sd;
+  }
+
+  return NULL;
+}
+
+void* restoreTheta2_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  for (HIT_INT_TYPE i = params->slotBegin; i < params->slotEnd; i++) fracs[i] = theta1[i];
+  return NULL;
+}
+
+// returns the OBJECTIVE of fracs before the step
+double emStep() {
+  double objective;
+
+  ++ROUND;
+  chromTable->prepareUpdate(ChromTable::FULL);
+  pool->run(emStep_per_thread, paramsPointers);
+  chromTable->finishUpdate();
+
+  objective = sumChunks(chunkObjectives);
+
+  fprintf(stderr, "ROUND = %d, MAX_DELTA = %.6g, OBJECTIVE = %.10g\n", ROUND, chromTable->getMaxDelta(), objective);
+
+  return objective;
+}
+
+// Each SQUAREM cycle takes two EM steps theta0 -> theta1 -> theta2, extrapolates from them and stabilizes the
+// extrapolated point with a third EM step. The OBJECTIVE is not monotone under EM, so the safeguard compares residuals
+// instead: the extrapolated point is kept if the EM step from it moves the fractions no more than the step from theta1
+// to theta2 did. Otherwise the cycle falls back to theta2 and takes one plain EM step from there, and the next cycle
+// extrapolates again.
+void accelerateMultiReads() {
+  bool converged;
+  double objective, prev_objective, delta, sr, sv, residual;
+
+  theta0.assign(ms[nMulti], 0.0);
+  theta1.assign(ms[nMulti], 0.0);
+
+  ROUND = 0;
+  converged = false;
+  objective = prev_objective = 0.0;
+  delta = 0.0;
+  while (!converged && ROUND < UPPERBOUND) {
+    pool->run(saveTheta0_per_thread, paramsPointers);
+    emStep();
+    if (ROUND == UPPERBOUND) break;
+
+    pool->run(saveTheta1_per_thread, paramsPointers);
+    objective = emStep();
+    delta = chromTable->getMaxDelta(); // change caused by a plain EM step
 
-    // update chromTable
-    chromTable->update(ROUND < UPPERBOUND);
+    if (ROUND < UPPERBOUND) {
+      pool->run(squaremNorms_per_thread, paramsPointers);
+      sr = sumChunks(chunkSrs); sv = sumChunks(chunkSvs); residual = sumChunks(chunkResiduals);
+      alpha = (sv > 0.0 ? -sqrt(sr / sv) : -1.0);
 
-    fprintf(stderr, "ROUND = %d, MAX_DELTA = %.6g\n", ROUND, chromTable->getMaxDelta());
+      if (alpha < -1.0) {
+	pool->run(squaremExtrapolate_per_thread, paramsPointers);
+	objective = emStep();
+	pool->run(squaremResidual_per_thread, paramsPointers);
+	if (sumChunks(chunkResiduals) > residual) {
+	  fprintf(stderr, "SQUAREM step with alpha = %.6g is rejected, take a plain EM step instead!\n", alpha);
+	  pool->run(restoreTheta2_per_thread, paramsPointers);
+	  if (ROUND == UPPERBOUND) break;
+	  objective = emStep();
+	  delta = chromTable->getMaxDelta();
+	}
+      }
+    }
+
+    converged = ROUND > 2 && delta <= tolerance && fabs(objective - prev_objective) <= rel_tolerance * fabs(prev_objective);
+    prev_objective = objective;
   }
+
+  if (UPPERBOUND > 0) fprintf(stderr, "SQUAREM %s after %d rounds, MAX_DELTA = %.6g\n", (converged ? "converged" : "reached the upper bound"), ROUND, delta);
+
+  vector<FRAC_TYPE>().swap(theta0);
+  vector<FRAC_TYPE>().swap(theta1);
+}
+
+inline int clusterOfCoord(HIT_INT_TYPE coord) {
+  return upper_bound(clusterFirsts.begin(), clusterFirsts.end(), coord) - clusterFirsts.begin() - 1;
+}
+
+// find the components with union-find over clusters, every multi-read joins the clusters of its alignments
+void buildComponents() {
+  vector<int> compOf, pos;
+  vector<HIT_INT_TYPE> sizes;
+  vector<pair<HIT_INT_TYPE, int> > order;
+  int nBig = 0;
+
+  chromTable->getClusters(clusters);
+  clusterFirsts.clear();
+  for (size_t i = 0; i < clusters.size(); i++) clusterFirsts.push_back(clusters[i].firstCoord);
+
+  UnionFind uf(clusters.size());
+  for (READ_INT_TYPE rid = 0; rid < nMulti; rid++) {
+    int first = clusterOfCoord(coordIds[ms[rid]]);
+    for (HIT_INT_TYPE j = ms[rid] + 1; j < ms[rid + 1]; j++) uf.join(first, clusterOfCoord(coordIds[j]));
+  }
+
+  // the root of a set is its smallest member, so components are numbered in the order of their first clusters
+  nComps = 0;
+  compOf.assign(clusters.size(), -1);
+  for (size_t i = 0; i < clusters.size(); i++) {
+    HIT_INT_TYPE root = uf.find(i);
+    compOf[i] = (root == i ? nComps++ : compOf[root]);
+  }
+
+  compClusterStarts.assign(nComps + 1, 0);
+  for (size_t i = 0; i < clusters.size(); i++) ++compClusterStarts[compOf[i] + 1];
+  for (int c = 0; c < nComps; c++) compClusterStarts[c + 1] += compClusterStarts[c];
+  pos.assign(compClusterStarts.begin(), compClusterStarts.end() - 1);
+  compClusters.resize(clusters.size());
+  for (size_t i = 0; i < clusters.size(); i++) compClusters[pos[compOf[i]]++] = i;
+
+  sizes.assign(nComps, 0);
+  compReadStarts.assign(nComps + 1, 0);
+  for (READ_INT_TYPE rid = 0; rid < nMulti; rid++) {
+    int c = compOf[clusterOfCoord(coordIds[ms[rid]])];
+    ++compReadStarts[c + 1];
+    sizes[c] += ms[rid + 1] - ms[rid];
+  }
+  for (int c = 0; c < nComps; c++) compReadStarts[c + 1] += compReadStarts[c];
+  pos.assign(compReadStarts.begin(), compReadStarts.end() - 1);
+  compReads.resize(nMulti);
+  for (READ_INT_TYPE rid = 0; rid < nMulti; rid++) compReads[pos[compOf[clusterOfCoord(coordIds[ms[rid]])]]++] = rid;
+
+  // a component holding more than 1 / (2 * nThreads) of all alignments is large
+  order.clear();
+  for (int c = 0; c < nComps; c++) order.push_back(make_pair(sizes[c], c));
+  sort(order.begin(), order.end());
+  smallComps.clear();
+  for (int i = nComps - 1; i >= 0; i--) {
+    if (nThreads > 1 && (double)order[i].first * 2 * nThreads > ms[nMulti]) { ++nBig; continue; }
+    smallComps.push_back(order[i].second);
+  }
+
+  compResults.assign(nComps, CompResult());
+
+  fprintf(stderr, "%d clusters form %d components, %d of them are large!\n", (int)clusters.size(), nComps, nBig);
+}
+
+double updateComponent(int c, bool updateWeight, vector<double>& prefix) {
+  double max_delta = 0.0;
+  for (HIT_INT_TYPE i = compClusterStarts[c]; i < compClusterStarts[c + 1]; i++)
+    max_delta = max(max_delta, chromTable->updateCluster(clusters[compClusters[i]], updateWeight, prefix));
+  return max_delta;
+}
+
+// Cut the reads of component c into chunks of compReads. Small and large components use the same chunks and sum
+// their OBJECTIVEs chunk by chunk, so a component gets the same result whether it is small or large.
+void componentChunks(int c, vector<HIT_INT_TYPE>& starts) {
+  HIT_INT_TYPE first = compReadStarts[c], len = compReadStarts[c + 1] - first;
+  int nc = numChunks(len);
+
+  starts.assign(nc + 1, first + len);
+  for (int k = 0; k < nc; k++) starts[k] = first + (HIT_INT_TYPE)((double)len * k / nc);
+}
+
+// plain EM on one component on the calling thread, the same steps as allocateMultiReads
+void solveComponent(int c, vector<double>& prefix) {
+  CompResult &res = compResults[c];
+  vector<HIT_INT_TYPE> starts;
+  bool lastRound;
+  double objective, prev_objective = 0.0;
+
+  componentChunks(c, starts);
+  res.max_delta = updateComponent(c, UPPERBOUND > 0, prefix);
+  for (res.rounds = 1; res.rounds <= UPPERBOUND; res.rounds++) {
+    lastRound = res.converged || res.rounds == UPPERBOUND;
+
+    res.objective = 0.0;
+    for (size_t k = 0; k + 1 < starts.size(); k++) {
+      objective = 0.0;
+      for (HIT_INT_TYPE i = starts[k]; i < starts[k + 1]; i++) objective += normalizeRead(compReads[i]);
+      res.objective += objective;
+    }
+    res.max_delta = updateComponent(c, !lastRound, prefix);
+
+    if (lastRound) break;
+
+    res.converged = hasConverged(res.rounds, res.max_delta, res.objective, prev_objective);
+    prev_objective = res.objective;
+  }
+}
+
+int nextComponent() {
+  int rc, c = -1;
+
+  rc = pthread_mutex_lock(&compLock);
+  pthread_assert(rc, "pthread_mutex_lock", "Cannot lock the component queue!");
+  if (nextSmallComp < (int)smallComps.size()) c = smallComps[nextSmallComp++];
+  rc = pthread_mutex_unlock(&compLock);
+  pthread_assert(rc, "pthread_mutex_unlock", "Cannot unlock the component queue!");
+
+  return c;
+}
+
+void* solveComponents_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  int c;
+
+  while ((c = nextComponent()) >= 0) solveComponent(c, params->prefix);
+
+  return NULL;
+}
+
+void* componentRound_per_thread(void* arg) {
+  Params *params = (Params*)arg;
+  double objective;
+
+  for (int k = params->compChunkBegin; k < params->compChunkEnd; k++) {
+    objective = 0.0;
+    for (HIT_INT_TYPE i = compChunkStarts[k]; i < compChunkStarts[k + 1]; i++) objective += normalizeRead(compReads[i]);
+    compChunkObjectives[k] = objective;
+  }
+
+  pool->barrier();
+  chromTable->update_per_thread(params->no);
+
+  return NULL;
+}
+
+// a large component runs the rounds of allocateMultiReads with its reads split among threads and updates restricted to its clusters
+void solveLargeComponent(int c) {
+  CompResult &res = compResults[c];
+  vector<ChromTable::Cluster> own;
+  bool lastRound;
+  double prev_objective = 0.0;
+
+  for (HIT_INT_TYPE i = compClusterStarts[c]; i < compClusterStarts[c + 1]; i++) own.push_back(clusters[compClusters[i]]);
+  chromTable->restrictTo(&own);
+  componentChunks(c, compChunkStarts);
+  int nc = compChunkStarts.size() - 1;
+  compChunkObjectives.assign(nc, 0.0);
+  for (int i = 0; i < nThreads; i++) {
+    paramsArray[i].compChunkBegin = (int)((int64_t)nc * i / nThreads);
+    paramsArray[i].compChunkEnd = (int)((int64_t)nc * (i + 1) / nThreads);
+  }
+
+  chromTable->update(UPPERBOUND > 0 ? ChromTable::FULL : ChromTable::VALUES_ONLY);
+  res.max_delta = chromTable->getMaxDelta();
+  for (res.rounds = 1; res.rounds <= UPPERBOUND; res.rounds++) {
+    lastRound = res.converged || res.rounds == UPPERBOUND;
+
+    chromTable->prepareUpdate(lastRound ? ChromTable::VALUES_ONLY : ChromTable::FULL);
+    pool->run(componentRound_per_thread, paramsPointers);
+    chromTable->finishUpdate();
+
+    res.max_delta = chromTable->getMaxDelta();
+    res.objective = sumChunks(compChunkObjectives);
+
+    fprintf(stderr, "COMPONENT = %d, ROUND = %d, MAX_DELTA = %.6g, OBJECTIVE = %.10g\n", c, res.rounds, res.max_delta, res.objective);
+
+    if (lastRound) break;
+
+    res.converged = hasConverged(res.rounds, res.max_delta, res.objective, prev_objective);
+    prev_objective = res.objective;
+  }
+
+  chromTable->restrictTo(NULL);
+}
+
+void allocateComponents() {
+  int nConverged, maxRounds;
+  double objective, max_delta;
+
+  buildComponents();
+
+  vector<bool> isSmall(nComps, false);
+  for (size_t i = 0; i < smallComps.size(); i++) isSmall[smallComps[i]] = true;
+  for (int c = 0; c < nComps; c++)
+    if (!isSmall[c]) solveLargeComponent(c);
+
+  pthread_mutex_init(&compLock, NULL);
+  nextSmallComp = 0;
+  pool->run(solveComponents_per_thread, paramsPointers);
+  pthread_mutex_destroy(&compLock);
+
+  nConverged = maxRounds = 0;
+  objective = max_delta = 0.0;
+  for (int c = 0; c < nComps; c++) {
+    if (compResults[c].converged) ++nConverged;
+    maxRounds = max(maxRounds, min(compResults[c].rounds, UPPERBOUND));
+    objective += compResults[c].objective;
+    max_delta = max(max_delta, compResults[c].max_delta);
+  }
+  if (UPPERBOUND > 0) fprintf(stderr, "EM converged in %d of %d components, the slowest took %d rounds, MAX_DELTA = %.6g, OBJECTIVE = %.10g\n", nConverged, nComps, maxRounds, max_delta, objective);
+
+  vector<ChromTable::Cluster>().swap(clusters);
+  vector<HIT_INT_TYPE>().swap(clusterFirsts);
+  vector<HIT_INT_TYPE>().swap(compReadStarts);
+  vector<HIT_INT_TYPE>().swap(compClusterStarts);
+  vector<READ_INT_TYPE>().swap(compReads);
+  vector<int>().swap(compClusters);
+  vector<int>().swap(smallComps);
+  vector<CompResult>().swap(compResults);
+}
+
+// keep the final fractions for output, the EM state is released afterwards
+void keepFinalFracs() {
+  multiFracs.resize(ms[nMulti]);
+  for (HIT_INT_TYPE i = 0; i < ms[nMulti]; i++) multiFracs[i] = fracs[slots[i]];
+}
+
+// EM over the alignments in memory, the final fractions are left in multiFracs
+void runEM() {
+  splitJobs_and_Init();
+  if (squarem) accelerateMultiReads();
+  else if (useComponents) allocateComponents();
+  else allocateMultiReads();
+  keepFinalFracs();
+
+  delete checkpoint; checkpoint = NULL;
+  delete chromTable; chromTable = NULL;
+  delete pool; pool = NULL;
 }
 
 void output() {
-  HIT_INT_TYPE p;
+  HIT_INT_TYPE p, q;
   BamAlignment b;
+  vector<FILE*> fracFs;
+  float frac;
 
-  char outF[STRLEN];
+  char outF[STRLEN], fileName[STRLEN];
 
   sprintf(outF, "%s.bam", outName);
 
-  samParser = new SamParser(inpType, inpF);
-  bamWriter = new BamWriter(outF, samParser->getHeader());
+  if (spillF[0] != 0) {
+    samParser = NULL;
+    spill = fopen(spillF, "rb");
+    general_assert(spill != NULL, "Cannot open " + cstrtos(spillF) + "!");
+    setvbuf(spill, NULL, _IOFBF, SPILL_BUFFER_SIZE);
+    bamWriter = new BamWriter(outF, spillHeader, nThreads);
+  }
+  else {
+    samParser = new SamParser(inpType, inpF, 0, nThreads);
+    bamWriter = new BamWriter(outF, samParser->getHeader(), nThreads);
+  }
+
+  if (outOfCore) {
+    fracFs.assign(nBuckets, NULL);
+    for (int i = 0; i < nBuckets; i++) {
+      bucketFileName(fileName, "fracs", i);
+      fracFs[i] = fopen(fileName, "rb");
+      general_assert(fracFs[i] != NULL, "Cannot open " + cstrtos(fileName) + "!");
+    }
+  }
 
-  HIT_INT_TYPE cnt = 0;
+  uint64_t cnt = 0;
 
-  p = 0;
-  while (samParser->next(b)) {
+  p = q = 0;
+  while (spill != NULL ? b.readRaw(spill) : samParser->next(b)) {
     if (b.isAligned()) {
-      b.setFrac(alignments[p++].frac);
+      if (outOfCore) {
+	int bucket = components->getBucket(b.getCid());
+	frac = 1.0;
+	if (bucket >= 0) general_assert(fread(&frac, sizeof(float), 1, fracFs[bucket]) == 1, "Fail to read the fractions of bucket " + itos(bucket) + "!");
+	b.setFrac(frac);
+      }
+      else {
+	general_assert(p < nAmts, "The input has more alignments than " + (resumeF[0] != 0 ? cstrtos(resumeF) : cstrtos("the loaded alignments")) + "!");
+	b.setFrac(alignments.isMulti(p++) ? multiFracs[q++] : 1.0);
+      }
     }
     bamWriter->write(b);
 
     ++cnt;
-    if (cnt % 1000000 == 0) fprintf(stderr, "%u FIN\n", cnt);
+    if (cnt % 1000000 == 0) fprintf(stderr, "%" PRIu64 " FIN\n", cnt);
   }
+  if (!outOfCore) general_assert(p == nAmts && q == multiFracs.size(), "The number of alignments written does not match the input!");
 
-  delete samParser;
+  if (spill != NULL) {
+    fclose(spill);
+    remove(spillF);
+    bam_header_destroy(spillHeader);
+  }
+  else delete samParser;
   delete bamWriter;
 
+  for (int i = 0; i < (int)fracFs.size(); i++) {
+    fclose(fracFs[i]);
+    bucketFileName(fileName, "fracs", i);
+    remove(fileName);
+  }
+
   fprintf(stderr, "Writing output is finished!\n");
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 7 || argc > 10) {
-    fprintf(stderr, "Usage : csem input_type input_file fragment_length UPPERBOUND output_name number_of_threads [--extend-reads] [--prior prior_file]\n");
+#ifndef CSEM64
+  mainArgv = argv;
+#endif
+
+  if (argc >= 5 && !strcmp(argv[1], "--build-cache")) {
+    assert(strlen(argv[2]) == 1);
+    inpType = argv[2][0];
+    strcpy(inpF, argv[3]);
+#ifndef CSEM64
+    chooseIndexWidth(); // before cacheF is set, the cache is judged by its input
+#endif
+    strcpy(cacheF, argv[4]);
+    nThreads = (argc > 5 ? atoi(argv[5]) : 1);
+    buildCache();
+    return 0;
+  }
+
+  if (argc == 4 && !strcmp(argv[1], "--convert-prior")) {
+    PriorFile::convert(argv[2], argv[3]);
+    return 0;
+  }
+
+  if (argc < 7) {
+    fprintf(stderr, "Usage : csem --build-cache input_type input_file cache_file [number_of_threads]\n");
+    fprintf(stderr, "Usage : csem --convert-prior text_prior_file binary_prior_file\n");
+    fprintf(stderr, "Usage : csem input_type input_file fragment_length UPPERBOUND output_name number_of_threads [--extend-reads] [--prior prior_file] [--tolerance max_delta] [--rel-tolerance rel_objective_change] [--squarem] [--active-set threshold] [--no-simd] [--spill spill_file] [--out-of-core bucket_size] [--components] [--checkpoint interval] [--resume checkpoint_file] [--cache cache_file] [--numa]\n");
     exit(-1);
   }
 
@@ -234,25 +1366,73 @@ int main(int argc, char* argv[]) {
 
   extendReads = false;
   priorF[0] = 0;
+  spillF[0] = 0; spill = NULL; spillHeader = NULL;
+  squarem = false;
+  activeSet = false; active_threshold = 0.0;
+  outOfCore = false; bucketSize = 0; components = NULL; nBuckets = 0;
+  useComponents = false;
+  checkpointInterval = 0; checkpoint = NULL; resumeF[0] = 0;
+  cacheF[0] = 0;
+  numa = false;
+  bool useSimd = true;
 
   for (int i = 7; i < argc; i++) {
     if (!strcmp(argv[i], "--extend-reads")) { extendReads = true; }
     if (!strcmp(argv[i], "--prior")) { assert(strlen(argv[i + 1]) > 0); strcpy(priorF, argv[i + 1]); }
+    if (!strcmp(argv[i], "--tolerance")) { assert(i + 1 < argc); tolerance = atof(argv[i + 1]); }
+    if (!strcmp(argv[i], "--rel-tolerance")) { assert(i + 1 < argc); rel_tolerance = atof(argv[i + 1]); }
+    if (!strcmp(argv[i], "--squarem")) { squarem = true; }
+    if (!strcmp(argv[i], "--active-set")) { assert(i + 1 < argc); activeSet = true; active_threshold = atof(argv[i + 1]); }
+    if (!strcmp(argv[i], "--no-simd")) { useSimd = false; }
+    if (!strcmp(argv[i], "--spill")) { assert(i + 1 < argc); strcpy(spillF, argv[i + 1]); }
+    if (!strcmp(argv[i], "--components")) { useComponents = true; }
+    if (!strcmp(argv[i], "--checkpoint")) { assert(i + 1 < argc); checkpointInterval = atoi(argv[i + 1]); }
+    if (!strcmp(argv[i], "--resume")) { assert(i + 1 < argc); strcpy(resumeF, argv[i + 1]); }
+    if (!strcmp(argv[i], "--numa")) { numa = true; }
+    if (!strcmp(argv[i], "--cache")) { assert(i + 1 < argc); strcpy(cacheF, argv[i + 1]); }
+    if (!strcmp(argv[i], "--out-of-core")) { assert(i + 1 < argc); outOfCore = true; bucketSize = atol(argv[i + 1]); }
   }
+
+  simd_init(useSimd);
+  fprintf(stderr, "Using %s kernels.\n", simd_name());
  
   halfws = fragment_length / 2;
 
   chrMap = NULL;
   chromTable = NULL;
+  pool = NULL;
 
-  loadData();
-  splitJobs_and_Init();
-  allocateMultiReads();
+  general_assert(!(squarem && activeSet), "--squarem and --active-set cannot be used together!");
+  general_assert(!(useComponents && (squarem || activeSet)), "--components cannot be used together with --squarem or --active-set!");
+  general_assert(!((checkpointInterval > 0 || resumeF[0] != 0) && (squarem || activeSet || useComponents || outOfCore)), "--checkpoint and --resume only work with plain EM!");
+  general_assert(!(resumeF[0] != 0 && spillF[0] != 0), "--resume cannot be used together with --spill!");
+  general_assert(!(cacheF[0] != 0 && (spillF[0] != 0 || outOfCore || resumeF[0] != 0)), "--cache cannot be used together with --spill, --out-of-core or --resume!");
+  general_assert(tolerance >= 0.0, "Tolerance cannot be negative!");
+  general_assert(!activeSet || active_threshold <= tolerance, "The --active-set threshold cannot exceed the tolerance!");
+#ifndef CSEM64
+  chooseIndexWidth();
+#endif
 
+  if (outOfCore) {
+    loadBuckets();
+    for (int i = 0; i < nBuckets; i++) {
+      loadBucket(i);
+      fprintf(stderr, "Bucket %d of %d: %" PRIu64 " reads, %" PRIu64 " alignments.\n", i + 1, nBuckets, (uint64_t)n, (uint64_t)nAmts);
+      runEM();
+      saveBucketFracs(i);
+    }
+    alignments.clear();
+    vector<float>().swap(multiFracs);
+  }
+  else {
+    if (resumeF[0] != 0) loadCheckpoint();
+    else loadData();
+    runEM();
+  }
   delete chrMap;
-  delete chromTable;
-  
+
   output();
+  delete components;
 
   return 0;
 }
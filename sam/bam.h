@@ -316,6 +316,19 @@ extern "C" {
 	 */
 	int sam_read1(tamFile fp, bam_header_t *header, bam1_t *b);
 
+	/*!
+	  @abstract         Parse the records of a SAM file on background threads
+	  @param  fp        SAM file handler, its header must have been read
+	  @param  header    header of fp, which must outlive the threads
+	  @param  n_threads number of parsing threads
+	  @return           0 if successful; otherwise negative
+
+	  @discussion sam_read1 still returns the records in file order. The
+	  threads are stopped by sam_close. If they cannot be started, nothing
+	  has been read and fp keeps parsing on the calling thread.
+	 */
+	int sam_set_read_threads(tamFile fp, const bam_header_t *header, int n_threads);
+
 	/*!
 	  @abstract       Read header information from a TAB-delimited list file.
 	  @param  fn_list file name for the list
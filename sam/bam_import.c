@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 #ifdef _WIN32
 #include <fcntl.h>
 #endif
@@ -61,12 +62,21 @@ unsigned short bam_char2flag_table[256] = {
 
 char *bam_nt16_rev_table = "=ACMGRSVTWYHKDBN";
 
+typedef struct {
+	char *name;
+	int len, m;
+	int32_t tid;
+} sam_tid_cache_t;
+
 struct __tamFile_t {
 	gzFile fp;
 	kstream_t *ks;
 	kstring_t *str;
 	uint64_t n_lines;
-	int is_first;
+	int is_first, first_dret; // is_first, if str holds the first field of the first record, which ended with first_dret
+	kstring_t line; // the line being parsed by sam_read1
+	sam_tid_cache_t tid_cache[2];
+	void *mt; // parallel parsing state, see sam_set_read_threads
 };
 
 char **__bam_get_lines(const char *fn, int *_n) // for bam_plcmd.c only
@@ -230,73 +240,93 @@ bam_header_t *sam_header_read(tamFile fp)
 	}
 	sam_header_parse(header);
 	bam_init_header_hash(header);
-	fp->is_first = 1;
+	fp->is_first = (ret >= 0);
+	fp->first_dret = dret;
 	return header;
 }
 
-int sam_read1(tamFile fp, bam_header_t *header, bam1_t *b)
+/* The tab-separated fields of a line are split in place: returns the next field and its length, 0 past the end */
+static inline char *sam_field(char **cur, char *end, int *len)
 {
-	int ret, doff, doff0, dret, z = 0;
-	bam1_core_t *c = &b->core;
-	kstring_t *str = fp->str;
-	kstream_t *ks = fp->ks;
-
-	if (fp->is_first) {
-		fp->is_first = 0;
-		ret = str->l;
-	} else {
-		do { // special consideration for empty lines
-			ret = ks_getuntil(fp->ks, KS_SEP_TAB, str, &dret);
-			if (ret >= 0) z += str->l + 1;
-		} while (ret == 0);
+	char *s = *cur, *t;
+	if (s > end) return 0;
+	t = (char*)memchr(s, '\t', end - s);
+	if (t == 0) t = end;
+	*t = 0;
+	*len = t - s;
+	*cur = t + 1;
+	return s;
+}
+
+/* Records mostly repeat the reference name of the record before, so the last lookup is kept */
+static inline int32_t sam_cached_tid(sam_tid_cache_t *cache, const bam_header_t *header, const char *name, int len)
+{
+	if (cache->name && cache->len == len && memcmp(cache->name, name, len) == 0) return cache->tid;
+	cache->tid = bam_get_tid(header, name);
+	if (cache->m < len + 1) {
+		cache->m = len + 1;
+		kroundup32(cache->m);
+		cache->name = (char*)realloc(cache->name, cache->m);
 	}
-	if (ret < 0) return -1;
-	++fp->n_lines;
-	doff = 0;
+	memcpy(cache->name, name, len + 1);
+	cache->len = len;
+	return cache->tid;
+}
 
+/* Parse line[0 .. l - 1], which is modified, into b. cache[0] serves RNAME and cache[1] RNEXT. Returns l + 1, or a
+   negative value if mandatory fields are missing. */
+static int sam_parse1(char *line, int l, const bam_header_t *header, bam1_t *b, int64_t n_line, sam_tid_cache_t *cache)
+{
+	int doff, doff0, len = 0;
+	char *cur = line, *end = line + l, *str;
+	bam1_core_t *c = &b->core;
+
+	doff = 0;
 	{ // name
-		c->l_qname = strlen(str->s) + 1;
-		memcpy(alloc_data(b, doff + c->l_qname) + doff, str->s, c->l_qname);
+		str = sam_field(&cur, end, &len);
+		c->l_qname = len + 1;
+		memcpy(alloc_data(b, doff + c->l_qname) + doff, str, c->l_qname);
 		doff += c->l_qname;
 	}
 	{ // flag
 		long flag;
 		char *s;
-		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret); z += str->l + 1;
-		flag = strtol((char*)str->s, &s, 0);
+		if ((str = sam_field(&cur, end, &len)) == 0) return -2;
+		flag = strtol(str, &s, 0);
 		if (*s) { // not the end of the string
 			flag = 0;
-			for (s = str->s; *s; ++s)
+			for (s = str; *s; ++s)
 				flag |= bam_char2flag_table[(int)*s];
 		}
 		c->flag = flag;
 	}
 	{ // tid, pos, qual
-		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret); z += str->l + 1; c->tid = bam_get_tid(header, str->s);
-		if (c->tid < 0 && strcmp(str->s, "*")) {
+		if ((str = sam_field(&cur, end, &len)) == 0) return -2;
+		c->tid = sam_cached_tid(&cache[0], header, str, len);
+		if (c->tid < 0 && strcmp(str, "*")) {
 			if (header->n_targets == 0) {
 				fprintf(stderr, "[sam_read1] missing header? Abort!\n");
 				exit(1);
-			} else fprintf(stderr, "[sam_read1] reference '%s' is recognized as '*'.\n", str->s);
+			} else fprintf(stderr, "[sam_read1] reference '%s' is recognized as '*'.\n", str);
 		}
-		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret); z += str->l + 1; c->pos = isdigit(str->s[0])? atoi(str->s) - 1 : -1;
-		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret); z += str->l + 1; c->qual = isdigit(str->s[0])? atoi(str->s) : 0;
-		if (ret < 0) return -2;
+		if ((str = sam_field(&cur, end, &len)) == 0) return -2;
+		c->pos = isdigit(str[0])? atoi(str) - 1 : -1;
+		if ((str = sam_field(&cur, end, &len)) == 0) return -2;
+		c->qual = isdigit(str[0])? atoi(str) : 0;
 	}
 	{ // cigar
 		char *s, *t;
 		int i, op;
 		long x;
 		c->n_cigar = 0;
-		if (ks_getuntil(ks, KS_SEP_TAB, str, &dret) < 0) return -3;
-		z += str->l + 1;
-		if (str->s[0] != '*') {
-			for (s = str->s; *s; ++s) {
+		if ((str = sam_field(&cur, end, &len)) == 0) return -3;
+		if (str[0] != '*') {
+			for (s = str; *s; ++s) {
 				if ((isalpha(*s)) || (*s=='=')) ++c->n_cigar;
-				else if (!isdigit(*s)) parse_error(fp->n_lines, "invalid CIGAR character");
+				else if (!isdigit(*s)) parse_error(n_line, "invalid CIGAR character");
 			}
 			b->data = alloc_data(b, doff + c->n_cigar * 4);
-			for (i = 0, s = str->s; i != c->n_cigar; ++i) {
+			for (i = 0, s = str; i != c->n_cigar; ++i) {
 				x = strtol(s, &t, 10);
 				op = toupper(*t);
 				if (op == 'M') op = BAM_CMATCH;
@@ -308,158 +338,403 @@ int sam_read1(tamFile fp, bam_header_t *header, bam1_t *b)
 				else if (op == 'P') op = BAM_CPAD;
 				else if (op == '=') op = BAM_CEQUAL;
 				else if (op == 'X') op = BAM_CDIFF;
-				else parse_error(fp->n_lines, "invalid CIGAR operation");
+				else parse_error(n_line, "invalid CIGAR operation");
 				s = t + 1;
 				bam1_cigar(b)[i] = x << BAM_CIGAR_SHIFT | op;
 			}
-			if (*s) parse_error(fp->n_lines, "unmatched CIGAR operation");
+			if (*s) parse_error(n_line, "unmatched CIGAR operation");
 			c->bin = bam_reg2bin(c->pos, bam_calend(c, bam1_cigar(b)));
 			doff += c->n_cigar * 4;
 		} else {
 			if (!(c->flag&BAM_FUNMAP)) {
-				fprintf(stderr, "Parse warning at line %lld: mapped sequence without CIGAR\n", (long long)fp->n_lines);
+				fprintf(stderr, "Parse warning at line %lld: mapped sequence without CIGAR\n", (long long)n_line);
 				c->flag |= BAM_FUNMAP;
 			}
 			c->bin = bam_reg2bin(c->pos, c->pos + 1);
 		}
 	}
 	{ // mtid, mpos, isize
-		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret); z += str->l + 1;
-		c->mtid = strcmp(str->s, "=")? bam_get_tid(header, str->s) : c->tid;
-		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret); z += str->l + 1;
-		c->mpos = isdigit(str->s[0])? atoi(str->s) - 1 : -1;
-		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret); z += str->l + 1;
-		c->isize = (str->s[0] == '-' || isdigit(str->s[0]))? atoi(str->s) : 0;
-		if (ret < 0) return -4;
+		if ((str = sam_field(&cur, end, &len)) == 0) return -4;
+		c->mtid = strcmp(str, "=")? sam_cached_tid(&cache[1], header, str, len) : c->tid;
+		if ((str = sam_field(&cur, end, &len)) == 0) return -4;
+		c->mpos = isdigit(str[0])? atoi(str) - 1 : -1;
+		if ((str = sam_field(&cur, end, &len)) == 0) return -4;
+		c->isize = (str[0] == '-' || isdigit(str[0]))? atoi(str) : 0;
 	}
 	{ // seq and qual
 		int i;
 		uint8_t *p = 0;
-		if (ks_getuntil(ks, KS_SEP_TAB, str, &dret) < 0) return -5; // seq
-		z += str->l + 1;
-		if (strcmp(str->s, "*")) {
-			c->l_qseq = strlen(str->s);
+		if ((str = sam_field(&cur, end, &len)) == 0) return -5; // seq
+		if (strcmp(str, "*")) {
+			c->l_qseq = len;
 			if (c->n_cigar && c->l_qseq != (int32_t)bam_cigar2qlen(c, bam1_cigar(b))) {
 			  fprintf(stderr, "Line %ld, sequence length %i vs %i from CIGAR\n",
-				  (long)fp->n_lines, c->l_qseq, (int32_t)bam_cigar2qlen(c, bam1_cigar(b)));
-			  parse_error(fp->n_lines, "CIGAR and sequence length are inconsistent");
+				  (long)n_line, c->l_qseq, (int32_t)bam_cigar2qlen(c, bam1_cigar(b)));
+			  parse_error(n_line, "CIGAR and sequence length are inconsistent");
 			}
 			p = (uint8_t*)alloc_data(b, doff + c->l_qseq + (c->l_qseq+1)/2) + doff;
 			memset(p, 0, (c->l_qseq+1)/2);
 			for (i = 0; i < c->l_qseq; ++i)
-				p[i/2] |= bam_nt16_table[(int)str->s[i]] << 4*(1-i%2);
+				p[i/2] |= bam_nt16_table[(int)str[i]] << 4*(1-i%2);
 		} else c->l_qseq = 0;
-		if (ks_getuntil(ks, KS_SEP_TAB, str, &dret) < 0) return -6; // qual
-		z += str->l + 1;
-		if (strcmp(str->s, "*") && c->l_qseq != strlen(str->s))
-			parse_error(fp->n_lines, "sequence and quality are inconsistent");
+		if ((str = sam_field(&cur, end, &len)) == 0) return -6; // qual
+		if (strcmp(str, "*") && c->l_qseq != len)
+			parse_error(n_line, "sequence and quality are inconsistent");
 		p += (c->l_qseq+1)/2;
-		if (strcmp(str->s, "*") == 0) for (i = 0; i < c->l_qseq; ++i) p[i] = 0xff;
-		else for (i = 0; i < c->l_qseq; ++i) p[i] = str->s[i] - 33;
+		if (strcmp(str, "*") == 0) for (i = 0; i < c->l_qseq; ++i) p[i] = 0xff;
+		else for (i = 0; i < c->l_qseq; ++i) p[i] = str[i] - 33;
 		doff += c->l_qseq + (c->l_qseq+1)/2;
 	}
 	doff0 = doff;
-	if (dret != '\n' && dret != '\r') { // aux
-		while (ks_getuntil(ks, KS_SEP_TAB, str, &dret) >= 0) {
-			uint8_t *s, type, key[2];
-			z += str->l + 1;
-			if (str->l < 6 || str->s[2] != ':' || str->s[4] != ':')
-				parse_error(fp->n_lines, "missing colon in auxiliary data");
-			key[0] = str->s[0]; key[1] = str->s[1];
-			type = str->s[3];
-			s = alloc_data(b, doff + 3) + doff;
-			s[0] = key[0]; s[1] = key[1]; s += 2; doff += 2;
-			if (type == 'A' || type == 'a' || type == 'c' || type == 'C') { // c and C for backward compatibility
-				s = alloc_data(b, doff + 2) + doff;
-				*s++ = 'A'; *s = str->s[5];
-				doff += 2;
-			} else if (type == 'I' || type == 'i') {
-				long long x;
-				s = alloc_data(b, doff + 5) + doff;
-				x = (long long)atoll(str->s + 5);
-				if (x < 0) {
-					if (x >= -127) {
-						*s++ = 'c'; *(int8_t*)s = (int8_t)x;
-						s += 1; doff += 2;
-					} else if (x >= -32767) {
-						*s++ = 's'; *(int16_t*)s = (int16_t)x;
-						s += 2; doff += 3;
-					} else {
-						*s++ = 'i'; *(int32_t*)s = (int32_t)x;
-						s += 4; doff += 5;
-						if (x < -2147483648ll)
-							fprintf(stderr, "Parse warning at line %lld: integer %lld is out of range.",
-									(long long)fp->n_lines, x);
-					}
+	// aux
+	while ((str = sam_field(&cur, end, &len)) != 0) {
+		uint8_t *s, type, key[2];
+		if (len < 6 || str[2] != ':' || str[4] != ':')
+			parse_error(n_line, "missing colon in auxiliary data");
+		key[0] = str[0]; key[1] = str[1];
+		type = str[3];
+		s = alloc_data(b, doff + 3) + doff;
+		s[0] = key[0]; s[1] = key[1]; s += 2; doff += 2;
+		if (type == 'A' || type == 'a' || type == 'c' || type == 'C') { // c and C for backward compatibility
+			s = alloc_data(b, doff + 2) + doff;
+			*s++ = 'A'; *s = str[5];
+			doff += 2;
+		} else if (type == 'I' || type == 'i') {
+			long long x;
+			s = alloc_data(b, doff + 5) + doff;
+			x = (long long)atoll(str + 5);
+			if (x < 0) {
+				if (x >= -127) {
+					*s++ = 'c'; *(int8_t*)s = (int8_t)x;
+					s += 1; doff += 2;
+				} else if (x >= -32767) {
+					*s++ = 's'; *(int16_t*)s = (int16_t)x;
+					s += 2; doff += 3;
 				} else {
-					if (x <= 255) {
-						*s++ = 'C'; *s++ = (uint8_t)x;
-						doff += 2;
-					} else if (x <= 65535) {
-						*s++ = 'S'; *(uint16_t*)s = (uint16_t)x;
-						s += 2; doff += 3;
-					} else {
-						*s++ = 'I'; *(uint32_t*)s = (uint32_t)x;
-						s += 4; doff += 5;
-						if (x > 4294967295ll)
-							fprintf(stderr, "Parse warning at line %lld: integer %lld is out of range.",
-									(long long)fp->n_lines, x);
-					}
+					*s++ = 'i'; *(int32_t*)s = (int32_t)x;
+					s += 4; doff += 5;
+					if (x < -2147483648ll)
+						fprintf(stderr, "Parse warning at line %lld: integer %lld is out of range.",
+								(long long)n_line, x);
 				}
-			} else if (type == 'f') {
-				s = alloc_data(b, doff + 5) + doff;
-				*s++ = 'f';
-				*(float*)s = (float)atof(str->s + 5);
-				s += 4; doff += 5;
-			} else if (type == 'd') {
-				s = alloc_data(b, doff + 9) + doff;
-				*s++ = 'd';
-				*(float*)s = (float)atof(str->s + 9);
-				s += 8; doff += 9;
-			} else if (type == 'Z' || type == 'H') {
-				int size = 1 + (str->l - 5) + 1;
-				if (type == 'H') { // check whether the hex string is valid
-					int i;
-					if ((str->l - 5) % 2 == 1) parse_error(fp->n_lines, "length of the hex string not even");
-					for (i = 0; i < str->l - 5; ++i) {
-						int c = toupper(str->s[5 + i]);
-						if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F')))
-							parse_error(fp->n_lines, "invalid hex character");
-					}
+			} else {
+				if (x <= 255) {
+					*s++ = 'C'; *s++ = (uint8_t)x;
+					doff += 2;
+				} else if (x <= 65535) {
+					*s++ = 'S'; *(uint16_t*)s = (uint16_t)x;
+					s += 2; doff += 3;
+				} else {
+					*s++ = 'I'; *(uint32_t*)s = (uint32_t)x;
+					s += 4; doff += 5;
+					if (x > 4294967295ll)
+						fprintf(stderr, "Parse warning at line %lld: integer %lld is out of range.",
+								(long long)n_line, x);
 				}
-				s = alloc_data(b, doff + size) + doff;
-				*s++ = type;
-				memcpy(s, str->s + 5, str->l - 5);
-				s[str->l - 5] = 0;
-				doff += size;
-			} else if (type == 'B') {
-				int32_t n = 0, Bsize, k = 0, size;
-				char *p;
-				if (str->l < 8) parse_error(fp->n_lines, "too few values in aux type B");
-				Bsize = bam_aux_type2size(str->s[5]); // the size of each element
-				for (p = (char*)str->s + 6; *p; ++p) // count the number of elements in the array
-					if (*p == ',') ++n;
-				p = str->s + 7; // now p points to the first number in the array
-				size = 6 + Bsize * n; // total number of bytes allocated to this tag
-				s = alloc_data(b, doff + 6 * Bsize * n) + doff; // allocate memory
-				*s++ = 'B'; *s++ = str->s[5];
-				memcpy(s, &n, 4); s += 4; // write the number of elements
-				if (str->s[5] == 'c')      while (p < str->s + str->l) ((int8_t*)s)[k++]   = (int8_t)strtol(p, &p, 0),   ++p;
-				else if (str->s[5] == 'C') while (p < str->s + str->l) ((uint8_t*)s)[k++]  = (uint8_t)strtol(p, &p, 0),  ++p;
-				else if (str->s[5] == 's') while (p < str->s + str->l) ((int16_t*)s)[k++]  = (int16_t)strtol(p, &p, 0),  ++p; // FIXME: avoid unaligned memory
-				else if (str->s[5] == 'S') while (p < str->s + str->l) ((uint16_t*)s)[k++] = (uint16_t)strtol(p, &p, 0), ++p;
-				else if (str->s[5] == 'i') while (p < str->s + str->l) ((int32_t*)s)[k++]  = (int32_t)strtol(p, &p, 0),  ++p;
-				else if (str->s[5] == 'I') while (p < str->s + str->l) ((uint32_t*)s)[k++] = (uint32_t)strtol(p, &p, 0), ++p;
-				else if (str->s[5] == 'f') while (p < str->s + str->l) ((float*)s)[k++]    = (float)strtod(p, &p),       ++p;
-				else parse_error(fp->n_lines, "unrecognized array type");
-				s += Bsize * n; doff += size;
-			} else parse_error(fp->n_lines, "unrecognized type");
-			if (dret == '\n' || dret == '\r') break;
-		}
+			}
+		} else if (type == 'f') {
+			s = alloc_data(b, doff + 5) + doff;
+			*s++ = 'f';
+			*(float*)s = (float)atof(str + 5);
+			s += 4; doff += 5;
+		} else if (type == 'd') {
+			s = alloc_data(b, doff + 9) + doff;
+			*s++ = 'd';
+			*(float*)s = (float)atof(str + 9);
+			s += 8; doff += 9;
+		} else if (type == 'Z' || type == 'H') {
+			int size = 1 + (len - 5) + 1;
+			if (type == 'H') { // check whether the hex string is valid
+				int i;
+				if ((len - 5) % 2 == 1) parse_error(n_line, "length of the hex string not even");
+				for (i = 0; i < len - 5; ++i) {
+					int c = toupper(str[5 + i]);
+					if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F')))
+						parse_error(n_line, "invalid hex character");
+				}
+			}
+			s = alloc_data(b, doff + size) + doff;
+			*s++ = type;
+			memcpy(s, str + 5, len - 5);
+			s[len - 5] = 0;
+			doff += size;
+		} else if (type == 'B') {
+			int32_t n = 0, Bsize, k = 0, size;
+			char *p;
+			if (len < 8) parse_error(n_line, "too few values in aux type B");
+			Bsize = bam_aux_type2size(str[5]); // the size of each element
+			for (p = (char*)str + 6; *p; ++p) // count the number of elements in the array
+				if (*p == ',') ++n;
+			p = str + 7; // now p points to the first number in the array
+			size = 6 + Bsize * n; // total number of bytes allocated to this tag
+			s = alloc_data(b, doff + 6 * Bsize * n) + doff; // allocate memory
+			*s++ = 'B'; *s++ = str[5];
+			memcpy(s, &n, 4); s += 4; // write the number of elements
+			if (str[5] == 'c')      while (p < str + len) ((int8_t*)s)[k++]   = (int8_t)strtol(p, &p, 0),   ++p;
+			else if (str[5] == 'C') while (p < str + len) ((uint8_t*)s)[k++]  = (uint8_t)strtol(p, &p, 0),  ++p;
+			else if (str[5] == 's') while (p < str + len) ((int16_t*)s)[k++]  = (int16_t)strtol(p, &p, 0),  ++p; // FIXME: avoid unaligned memory
+			else if (str[5] == 'S') while (p < str + len) ((uint16_t*)s)[k++] = (uint16_t)strtol(p, &p, 0), ++p;
+			else if (str[5] == 'i') while (p < str + len) ((int32_t*)s)[k++]  = (int32_t)strtol(p, &p, 0),  ++p;
+			else if (str[5] == 'I') while (p < str + len) ((uint32_t*)s)[k++] = (uint32_t)strtol(p, &p, 0), ++p;
+			else if (str[5] == 'f') while (p < str + len) ((float*)s)[k++]    = (float)strtod(p, &p),       ++p;
+			else parse_error(n_line, "unrecognized array type");
+			s += Bsize * n; doff += size;
+		} else parse_error(n_line, "unrecognized type");
 	}
 	b->l_aux = doff - doff0;
 	b->data_len = doff;
-	return z;
+	return l + 1;
+}
+
+/* Append the next non-empty line to str without its line break; returns its length, -1 at the end of the file */
+static int sam_getline(tamFile fp, kstring_t *str)
+{
+	size_t start = str->l;
+	int dret, len;
+
+	do {
+		str->l = start;
+		if (fp->is_first) { // sam_header_read has taken the first field of this line already
+			fp->is_first = 0;
+			kputsn(fp->str->s, fp->str->l, str);
+			if (fp->first_dret != '\n') {
+				kputc(fp->first_dret, str);
+				ks_getuntil2(fp->ks, '\n', str, &dret, 1);
+			}
+		} else if (ks_getuntil2(fp->ks, '\n', str, &dret, 1) < 0) {
+			str->l = start;
+			return -1;
+		}
+		len = str->l - start;
+		if (len > 0 && str->s[str->l - 1] == '\r') str->s[--str->l] = 0, --len;
+	} while (len == 0); // special consideration for empty lines
+	return len;
+}
+
+static int sam_mt_read1(tamFile fp, bam1_t *b);
+
+int sam_read1(tamFile fp, bam_header_t *header, bam1_t *b)
+{
+	int len;
+
+	if (fp->mt) return sam_mt_read1(fp, b);
+
+	fp->line.l = 0;
+	if ((len = sam_getline(fp, &fp->line)) < 0) return -1;
+	++fp->n_lines;
+	return sam_parse1(fp->line.s, len, header, b, fp->n_lines, fp->tid_cache);
+}
+
+/* Parallel parsing. The reader thread cuts the input into chunks of whole lines and puts them into a ring of slots
+   in file order: chunk n_read goes into its slot once the consumer has left chunk n_read - n_slots. Workers turn the
+   lines of a chunk into records, each with its own reference name cache, and sam_read1 hands the records out in
+   order, so the record order is that of the file. Only the reader touches the file. */
+
+#define SAM_MT_CHUNK_SIZE 0x100000 // bytes of text per chunk, at least one line
+#define SAM_MT_CHUNK_LINES 8192
+
+enum { SAM_MT_LOADED, SAM_MT_BUSY, SAM_MT_READY };
+
+typedef struct {
+	int state;
+	kstring_t text; // lines of the chunk, each followed by a '\0'
+	int n_lines, m_lines, *offsets, *lens;
+	int64_t first_line; // number of the first line, for error messages
+	bam1_t *records;
+	int n_records, n_taken; // lines parsed into records and records taken by the consumer
+	int ret; // if n_records < n_lines, the return value of sam_parse1 for line n_records
+} sam_mt_slot_t;
+
+typedef struct {
+	tamFile fp;
+	const bam_header_t *header;
+	int n_threads, n_slots;
+	sam_mt_slot_t *slots;
+	int64_t n_read, n_claimed, n_taken; // chunks read by the reader, claimed by workers and left by the consumer
+	int done_reading, stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond_reader, cond_worker, cond_consumer;
+	pthread_t reader, *workers;
+} sam_mt_t;
+
+static void *sam_mt_reader_func(void *data)
+{
+	sam_mt_t *mt = (sam_mt_t*)data;
+	tamFile fp = mt->fp;
+	sam_mt_slot_t *slot;
+	int len = 0;
+
+	while (1) {
+		pthread_mutex_lock(&mt->lock);
+		while (!mt->stop && mt->n_read - mt->n_taken >= mt->n_slots) pthread_cond_wait(&mt->cond_reader, &mt->lock);
+		if (mt->stop) { pthread_mutex_unlock(&mt->lock); break; }
+		slot = &mt->slots[mt->n_read % mt->n_slots];
+		pthread_mutex_unlock(&mt->lock);
+
+		slot->text.l = 0;
+		slot->n_lines = 0;
+		slot->first_line = fp->n_lines + 1;
+		while (slot->text.l < SAM_MT_CHUNK_SIZE && slot->n_lines < SAM_MT_CHUNK_LINES) {
+			if (slot->n_lines == slot->m_lines) {
+				slot->m_lines = slot->m_lines? slot->m_lines << 1 : 1024;
+				slot->offsets = (int*)realloc(slot->offsets, slot->m_lines * sizeof(int));
+				slot->lens = (int*)realloc(slot->lens, slot->m_lines * sizeof(int));
+				slot->records = (bam1_t*)realloc(slot->records, slot->m_lines * sizeof(bam1_t));
+				memset(slot->records + slot->n_lines, 0, (slot->m_lines - slot->n_lines) * sizeof(bam1_t));
+			}
+			slot->offsets[slot->n_lines] = slot->text.l;
+			if ((len = sam_getline(fp, &slot->text)) < 0) break;
+			++slot->text.l; // keep the '\0' after the line
+			slot->lens[slot->n_lines++] = len;
+		}
+		fp->n_lines += slot->n_lines;
+
+		pthread_mutex_lock(&mt->lock);
+		if (slot->n_lines > 0) {
+			slot->state = SAM_MT_LOADED;
+			++mt->n_read;
+		}
+		if (len < 0) mt->done_reading = 1;
+		pthread_cond_broadcast(&mt->cond_worker);
+		pthread_cond_broadcast(&mt->cond_consumer);
+		pthread_mutex_unlock(&mt->lock);
+		if (len < 0) break;
+	}
+	return 0;
+}
+
+static void *sam_mt_worker_func(void *data)
+{
+	sam_mt_t *mt = (sam_mt_t*)data;
+	sam_mt_slot_t *slot;
+	sam_tid_cache_t cache[2];
+	int i, ret = 0;
+
+	memset(cache, 0, sizeof(cache));
+	while (1) {
+		pthread_mutex_lock(&mt->lock);
+		while (!mt->stop && mt->n_claimed == mt->n_read && !mt->done_reading) pthread_cond_wait(&mt->cond_worker, &mt->lock);
+		if (mt->stop || mt->n_claimed == mt->n_read) { pthread_mutex_unlock(&mt->lock); break; }
+		slot = &mt->slots[mt->n_claimed++ % mt->n_slots];
+		slot->state = SAM_MT_BUSY;
+		pthread_mutex_unlock(&mt->lock);
+
+		for (i = 0; i < slot->n_lines; ++i)
+			if ((ret = sam_parse1(slot->text.s + slot->offsets[i], slot->lens[i], mt->header, &slot->records[i], slot->first_line + i, cache)) < 0) break;
+
+		pthread_mutex_lock(&mt->lock);
+		slot->n_records = i;
+		slot->n_taken = 0;
+		slot->ret = ret;
+		slot->state = SAM_MT_READY;
+		pthread_cond_broadcast(&mt->cond_consumer);
+		pthread_mutex_unlock(&mt->lock);
+	}
+	free(cache[0].name); free(cache[1].name);
+	return 0;
+}
+
+static int sam_mt_read1(tamFile fp, bam1_t *b)
+{
+	sam_mt_t *mt = (sam_mt_t*)fp->mt;
+	sam_mt_slot_t *slot;
+	bam1_t tmp;
+
+	pthread_mutex_lock(&mt->lock);
+	while (1) {
+		if (mt->n_taken < mt->n_read) {
+			slot = &mt->slots[mt->n_taken % mt->n_slots];
+			if (slot->state == SAM_MT_READY) {
+				if (slot->n_taken < slot->n_records) break;
+				if (slot->n_records < slot->n_lines) { // a broken line ends the input
+					pthread_mutex_unlock(&mt->lock);
+					return slot->ret;
+				}
+				++mt->n_taken; // the chunk is used up
+				pthread_cond_signal(&mt->cond_reader);
+				continue;
+			}
+		}
+		else if (mt->done_reading) { // end of file
+			pthread_mutex_unlock(&mt->lock);
+			return -1;
+		}
+		pthread_cond_wait(&mt->cond_consumer, &mt->lock);
+	}
+	pthread_mutex_unlock(&mt->lock);
+
+	// hand the record over instead of copying it, the slot keeps b's old buffer
+	tmp = *b; *b = slot->records[slot->n_taken]; slot->records[slot->n_taken] = tmp;
+	return slot->lens[slot->n_taken++] + 1;
+}
+
+// stop the reader thread, if it was started, and the first n_threads workers, then free mt
+static void sam_mt_free(sam_mt_t *mt, int has_reader)
+{
+	int i, j;
+
+	pthread_mutex_lock(&mt->lock);
+	mt->stop = 1;
+	pthread_cond_broadcast(&mt->cond_reader);
+	pthread_cond_broadcast(&mt->cond_worker);
+	pthread_mutex_unlock(&mt->lock);
+	if (has_reader) pthread_join(mt->reader, 0);
+	for (i = 0; i < mt->n_threads; ++i) pthread_join(mt->workers[i], 0);
+
+	for (i = 0; i < mt->n_slots; ++i) {
+		sam_mt_slot_t *slot = &mt->slots[i];
+		for (j = 0; j < slot->m_lines; ++j) free(slot->records[j].data);
+		free(slot->records);
+		free(slot->offsets); free(slot->lens);
+		free(slot->text.s);
+	}
+	free(mt->slots);
+	free(mt->workers);
+	pthread_mutex_destroy(&mt->lock);
+	pthread_cond_destroy(&mt->cond_reader);
+	pthread_cond_destroy(&mt->cond_worker);
+	pthread_cond_destroy(&mt->cond_consumer);
+	free(mt);
+}
+
+static void sam_mt_destroy(tamFile fp)
+{
+	sam_mt_free((sam_mt_t*)fp->mt, 1);
+	fp->mt = 0;
+}
+
+int sam_set_read_threads(tamFile fp, const bam_header_t *header, int n_threads)
+{
+	sam_mt_t *mt;
+
+	if (fp->mt || n_threads < 1) return -1;
+
+	mt = (sam_mt_t*)calloc(1, sizeof(sam_mt_t));
+	mt->fp = fp;
+	mt->header = header;
+	mt->n_slots = 4 * n_threads + 4;
+	mt->slots = (sam_mt_slot_t*)calloc(mt->n_slots, sizeof(sam_mt_slot_t));
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->cond_reader, 0);
+	pthread_cond_init(&mt->cond_worker, 0);
+	pthread_cond_init(&mt->cond_consumer, 0);
+	mt->workers = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+	// the workers wait for the reader, which is started last so that nothing is read if any thread fails;
+	// fp->mt is only set once every thread runs, so a failure leaves fp parsing on the calling thread
+	for (; mt->n_threads < n_threads; ++mt->n_threads)
+		if (pthread_create(&mt->workers[mt->n_threads], 0, sam_mt_worker_func, mt) != 0) {
+			fprintf(stderr, "[sam_set_read_threads] cannot create parsing threads\n");
+			sam_mt_free(mt, 0);
+			return -1;
+		}
+	if (pthread_create(&mt->reader, 0, sam_mt_reader_func, mt) != 0) {
+		fprintf(stderr, "[sam_set_read_threads] cannot create the reader thread\n");
+		sam_mt_free(mt, 0);
+		return -1;
+	}
+	fp->mt = mt;
+	return 0;
 }
 
 tamFile sam_open(const char *fn)
@@ -477,6 +752,9 @@ tamFile sam_open(const char *fn)
 void sam_close(tamFile fp)
 {
 	if (fp) {
+		if (fp->mt) sam_mt_destroy(fp);
+		free(fp->line.s);
+		free(fp->tid_cache[0].name); free(fp->tid_cache[1].name);
 		ks_destroy(fp->ks);
 		gzclose(fp->fp);
 		free(fp->str->s); free(fp->str);
@@ -81,12 +81,13 @@ static void swap_header_text(bam_header_t *h1, bam_header_t *h2)
                    or NULL to copy them from the first file to be merged
   @param  n    number of files to be merged
   @param  fn   names of files to be merged
+  @param  n_threads  number of threads deflating the output
 
   @discussion Padding information may NOT correctly maintained. This
   function is NOT thread safe.
  */
 int bam_merge_core(int by_qname, const char *out, const char *headers, int n, char * const *fn,
-					int flag, const char *reg)
+					int flag, const char *reg, int n_threads)
 {
 	bamFile fpout, *fp;
 	heap1_t *heap;
@@ -216,6 +217,7 @@ int bam_merge_core(int by_qname, const char *out, const char *headers, int n, ch
 		fprintf(stderr, "[%s] fail to create the output file.\n", __func__);
 		return -1;
 	}
+	if (n_threads > 1) bgzf_set_write_threads(fpout, n_threads);
 	bam_header_write(fpout, hout);
 	bam_header_destroy(hout);
 
@@ -254,10 +256,10 @@ int bam_merge_core(int by_qname, const char *out, const char *headers, int n, ch
 
 int bam_merge(int argc, char *argv[])
 {
-	int c, is_by_qname = 0, flag = 0, ret = 0;
+	int c, is_by_qname = 0, flag = 0, ret = 0, n_threads = 1;
 	char *fn_headers = NULL, *reg = 0;
 
-	while ((c = getopt(argc, argv, "h:nru1R:f")) >= 0) {
+	while ((c = getopt(argc, argv, "h:nru1R:f@:")) >= 0) {
 		switch (c) {
 		case 'r': flag |= MERGE_RG; break;
 		case 'f': flag |= MERGE_FORCE; break;
@@ -266,6 +268,7 @@ int bam_merge(int argc, char *argv[])
 		case '1': flag |= MERGE_LEVEL1; break;
 		case 'u': flag |= MERGE_UNCOMP; break;
 		case 'R': reg = strdup(optarg); break;
+		case '@': n_threads = atoi(optarg); break;
 		}
 	}
 	if (optind + 2 >= argc) {
@@ -277,6 +280,7 @@ int bam_merge(int argc, char *argv[])
 		fprintf(stderr, "         -f       overwrite the output BAM if exist\n");
 		fprintf(stderr, "         -1       compress level 1\n");
 		fprintf(stderr, "         -R STR   merge file in the specified region STR [all]\n");
+		fprintf(stderr, "         -@ INT   number of threads compressing the output [1]\n");
 		fprintf(stderr, "         -h FILE  copy the header in FILE to <out.bam> [in1.bam]\n\n");
 		fprintf(stderr, "Note: Samtools' merge does not reconstruct the @RG dictionary in the header. Users\n");
 		fprintf(stderr, "      must provide the correct header with -h, or uses Picard which properly maintains\n");
@@ -291,7 +295,7 @@ int bam_merge(int argc, char *argv[])
 			return 1;
 		}
 	}
-	if (bam_merge_core(is_by_qname, argv[optind], fn_headers, argc - optind - 1, argv + optind + 1, flag, reg) < 0) ret = 1;
+	if (bam_merge_core(is_by_qname, argv[optind], fn_headers, argc - optind - 1, argv + optind + 1, flag, reg, n_threads) < 0) ret = 1;
 	free(reg);
 	free(fn_headers);
 	return ret;
@@ -308,7 +312,7 @@ static inline int bam1_lt(const bam1_p a, const bam1_p b)
 }
 KSORT_INIT(sort, bam1_p, bam1_lt)
 
-static void sort_blocks(int n, int k, bam1_p *buf, const char *prefix, const bam_header_t *h, int is_stdout)
+static void sort_blocks(int n, int k, bam1_p *buf, const char *prefix, const bam_header_t *h, int is_stdout, int n_threads)
 {
 	char *name, mode[3];
 	int i;
@@ -330,6 +334,7 @@ static void sort_blocks(int n, int k, bam1_p *buf, const char *prefix, const bam
 		return;
 	}
 	free(name);
+	if (n_threads > 1) bgzf_set_write_threads(fp, n_threads);
 	bam_header_write(fp, h);
 	for (i = 0; i < k; ++i)
 		bam_write1_core(fp, &buf[i]->core, buf[i]->data_len, buf[i]->data);
@@ -345,12 +350,13 @@ static void sort_blocks(int n, int k, bam1_p *buf, const char *prefix, const bam
   @param  prefix   prefix of the output and the temporary files; upon
 	                   sucessess, prefix.bam will be written.
   @param  max_mem  approxiate maximum memory (very inaccurate)
+  @param  n_threads  number of threads deflating the output and temporary files
 
   @discussion It may create multiple temporary subalignment files
   and then merge them by calling bam_merge_core(). This function is
   NOT thread safe.
  */
-void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size_t max_mem, int is_stdout)
+void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size_t max_mem, int is_stdout, int n_threads)
 {
 	int n, ret, k, i;
 	size_t mem;
@@ -375,17 +381,17 @@ void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size
 		mem += ret;
 		++k;
 		if (mem >= max_mem) {
-			sort_blocks(n++, k, buf, prefix, header, 0);
+			sort_blocks(n++, k, buf, prefix, header, 0, n_threads);
 			mem = 0; k = 0;
 		}
 	}
 	if (ret != -1)
 		fprintf(stderr, "[bam_sort_core] truncated file. Continue anyway.\n");
-	if (n == 0) sort_blocks(-1, k, buf, prefix, header, is_stdout);
+	if (n == 0) sort_blocks(-1, k, buf, prefix, header, is_stdout, n_threads);
 	else { // then merge
 		char **fns, *fnout;
 		fprintf(stderr, "[bam_sort_core] merging from %d files...\n", n+1);
-		sort_blocks(n++, k, buf, prefix, header, 0);
+		sort_blocks(n++, k, buf, prefix, header, 0, n_threads);
 		fnout = (char*)calloc(strlen(prefix) + 20, 1);
 		if (is_stdout) sprintf(fnout, "-");
 		else sprintf(fnout, "%s.bam", prefix);
@@ -394,7 +400,7 @@ void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size
 			fns[i] = (char*)calloc(strlen(prefix) + 20, 1);
 			sprintf(fns[i], "%s.%.4d.bam", prefix, i);
 		}
-		bam_merge_core(is_by_qname, fnout, 0, n, fns, 0, 0);
+		bam_merge_core(is_by_qname, fnout, 0, n, fns, 0, 0, n_threads);
 		free(fnout);
 		for (i = 0; i < n; ++i) {
 			unlink(fns[i]);
@@ -415,24 +421,25 @@ void bam_sort_core_ext(int is_by_qname, const char *fn, const char *prefix, size
 
 void bam_sort_core(int is_by_qname, const char *fn, const char *prefix, size_t max_mem)
 {
-	bam_sort_core_ext(is_by_qname, fn, prefix, max_mem, 0);
+	bam_sort_core_ext(is_by_qname, fn, prefix, max_mem, 0, 1);
 }
 
 int bam_sort(int argc, char *argv[])
 {
 	size_t max_mem = 500000000;
-	int c, is_by_qname = 0, is_stdout = 0;
-	while ((c = getopt(argc, argv, "nom:")) >= 0) {
+	int c, is_by_qname = 0, is_stdout = 0, n_threads = 1;
+	while ((c = getopt(argc, argv, "nom:@:")) >= 0) {
 		switch (c) {
 		case 'o': is_stdout = 1; break;
 		case 'n': is_by_qname = 1; break;
 		case 'm': max_mem = atol(optarg); break;
+		case '@': n_threads = atoi(optarg); break;
 		}
 	}
 	if (optind + 2 > argc) {
-		fprintf(stderr, "Usage: samtools sort [-on] [-m <maxMem>] <in.bam> <out.prefix>\n");
+		fprintf(stderr, "Usage: samtools sort [-on] [-m <maxMem>] [-@ <threads>] <in.bam> <out.prefix>\n");
 		return 1;
 	}
-	bam_sort_core_ext(is_by_qname, argv[optind], argv[optind+1], max_mem, is_stdout);
+	bam_sort_core_ext(is_by_qname, argv[optind], argv[optind+1], max_mem, is_stdout, n_threads);
 	return 0;
 }
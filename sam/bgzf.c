@@ -22,6 +22,7 @@
 */
 
 /*
+  Multi-threaded read-ahead: a reader thread fetches compressed blocks and worker threads inflate them.
   2009-06-29 by lh3: cache recent uncompressed blocks.
   2009-06-25 by lh3: optionally use my knetfile library to access file on a FTP.
   2009-06-12 by lh3: support a mode string like "wu" where 'u' for uncompressed output */
@@ -33,6 +34,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "bgzf.h"
 
 #include "khash.h"
@@ -198,6 +200,7 @@ open_write(int fd, int compress_level) // compress_level==-1 for the default lev
     fp->block_offset = 0;
     fp->block_length = 0;
     fp->error = NULL;
+    fp->mt = NULL;
     return fp;
 }
 
@@ -260,16 +263,14 @@ bgzf_fdopen(int fd, const char * __restrict mode)
     }
 }
 
+// Deflate input into one BGZF block in buffer, returns the block size or -1 with *error set.
+// Blocks that do not compress enough are cut short, *input_length receives the number of bytes taken.
+// With reuse, the already initialized stream is reset instead of being set up for every block.
 static
 int
-deflate_block(BGZF* fp, int block_length)
+deflate_data(z_stream* reuse, int level, const bgzf_byte_t* input, int block_length,
+             bgzf_byte_t* buffer, int buffer_size, int* input_length, const char** error)
 {
-    // Deflate the block in fp->uncompressed_block into fp->compressed_block.
-    // Also adds an extra field that stores the compressed block length.
-
-    bgzf_byte_t* buffer = fp->compressed_block;
-    int buffer_size = fp->compressed_block_size;
-
     // Init gzip header
     buffer[0] = GZIP_ID1;
     buffer[1] = GZIP_ID2;
@@ -291,51 +292,56 @@ deflate_block(BGZF* fp, int block_length)
     buffer[17] = 0;
 
     // loop to retry for blocks that do not compress enough
-    int input_length = block_length;
+    *input_length = block_length;
     int compressed_length = 0;
     while (1) {
-        z_stream zs;
-        zs.zalloc = NULL;
-        zs.zfree = NULL;
-        zs.next_in = fp->uncompressed_block;
-        zs.avail_in = input_length;
-        zs.next_out = (void*)&buffer[BLOCK_HEADER_LENGTH];
-        zs.avail_out = buffer_size - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-
-        int status = deflateInit2(&zs, fp->compress_level, Z_DEFLATED,
+        z_stream local, *zs = reuse? reuse : &local;
+        int status;
+        if (reuse) {
+            status = deflateReset(zs);
+        } else {
+            zs->zalloc = NULL;
+            zs->zfree = NULL;
+            zs->opaque = NULL;
+            status = deflateInit2(zs, level, Z_DEFLATED,
                                   GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+        }
         if (status != Z_OK) {
-            report_error(fp, "deflate init failed");
+            *error = "deflate init failed";
             return -1;
         }
-        status = deflate(&zs, Z_FINISH);
+        zs->next_in = (Bytef*)input;
+        zs->avail_in = *input_length;
+        zs->next_out = (void*)&buffer[BLOCK_HEADER_LENGTH];
+        zs->avail_out = buffer_size - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+
+        status = deflate(zs, Z_FINISH);
         if (status != Z_STREAM_END) {
-            deflateEnd(&zs);
+            if (!reuse) deflateEnd(zs);
             if (status == Z_OK) {
                 // Not enough space in buffer.
                 // Can happen in the rare case the input doesn't compress enough.
                 // Reduce the amount of input until it fits.
-                input_length -= 1024;
-                if (input_length <= 0) {
+                *input_length -= 1024;
+                if (*input_length <= 0) {
                     // should never happen
-                    report_error(fp, "input reduction failed");
+                    *error = "input reduction failed";
                     return -1;
                 }
                 continue;
             }
-            report_error(fp, "deflate failed");
+            *error = "deflate failed";
             return -1;
         }
-        status = deflateEnd(&zs);
-        if (status != Z_OK) {
-            report_error(fp, "deflate end failed");
+        compressed_length = zs->total_out;
+        if (!reuse && deflateEnd(zs) != Z_OK) {
+            *error = "deflate end failed";
             return -1;
         }
-        compressed_length = zs.total_out;
         compressed_length += BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
         if (compressed_length > MAX_BLOCK_SIZE) {
             // should never happen
-            report_error(fp, "deflate overflow");
+            *error = "deflate overflow";
             return -1;
         }
         break;
@@ -343,9 +349,26 @@ deflate_block(BGZF* fp, int block_length)
 
     packInt16((uint8_t*)&buffer[16], compressed_length-1);
     uint32_t crc = crc32(0L, NULL, 0L);
-    crc = crc32(crc, fp->uncompressed_block, input_length);
+    crc = crc32(crc, (const Bytef*)input, *input_length);
     packInt32((uint8_t*)&buffer[compressed_length-8], crc);
-    packInt32((uint8_t*)&buffer[compressed_length-4], input_length);
+    packInt32((uint8_t*)&buffer[compressed_length-4], *input_length);
+    return compressed_length;
+}
+
+static
+int
+deflate_block(BGZF* fp, int block_length)
+{
+    // Deflate the block in fp->uncompressed_block into fp->compressed_block.
+    // Also adds an extra field that stores the compressed block length.
+    const char *error = NULL;
+    int input_length;
+    int compressed_length = deflate_data(NULL, fp->compress_level, fp->uncompressed_block, block_length,
+                                         fp->compressed_block, fp->compressed_block_size, &input_length, &error);
+    if (compressed_length < 0) {
+        report_error(fp, error);
+        return -1;
+    }
 
     int remaining = block_length - input_length;
     if (remaining > 0) {
@@ -362,40 +385,50 @@ deflate_block(BGZF* fp, int block_length)
     return compressed_length;
 }
 
+// Inflate a compressed block into output, returns the inflated length or -1 with *error set
 static
 int
-inflate_block(BGZF* fp, int block_length)
+inflate_data(const bgzf_byte_t* compressed, int block_length, void* output, int output_size, const char** error)
 {
-    // Inflate the block in fp->compressed_block into fp->uncompressed_block
-
     z_stream zs;
 	int status;
     zs.zalloc = NULL;
     zs.zfree = NULL;
-    zs.next_in = fp->compressed_block + 18;
+    zs.next_in = (Bytef*)compressed + 18;
     zs.avail_in = block_length - 16;
-    zs.next_out = fp->uncompressed_block;
-    zs.avail_out = fp->uncompressed_block_size;
+    zs.next_out = output;
+    zs.avail_out = output_size;
 
     status = inflateInit2(&zs, GZIP_WINDOW_BITS);
     if (status != Z_OK) {
-        report_error(fp, "inflate init failed");
+        *error = "inflate init failed";
         return -1;
     }
     status = inflate(&zs, Z_FINISH);
     if (status != Z_STREAM_END) {
         inflateEnd(&zs);
-        report_error(fp, "inflate failed");
+        *error = "inflate failed";
         return -1;
     }
     status = inflateEnd(&zs);
     if (status != Z_OK) {
-        report_error(fp, "inflate failed");
+        *error = "inflate failed";
         return -1;
     }
     return zs.total_out;
 }
 
+static
+int
+inflate_block(BGZF* fp, int block_length)
+{
+    // Inflate the block in fp->compressed_block into fp->uncompressed_block
+	const char *error = NULL;
+	int count = inflate_data(fp->compressed_block, block_length, fp->uncompressed_block, fp->uncompressed_block_size, &error);
+	if (count < 0) report_error(fp, error);
+	return count;
+}
+
 static
 int
 check_header(const bgzf_byte_t* header)
@@ -467,47 +500,69 @@ static void cache_block(BGZF *fp, int size)
 	memcpy(kh_val(h, k).block, fp->uncompressed_block, MAX_BLOCK_SIZE);
 }
 
-int
-bgzf_read_block(BGZF* fp)
+static inline int64_t raw_tell(BGZF *fp)
 {
-    bgzf_byte_t header[BLOCK_HEADER_LENGTH];
-	int count, size = 0, block_length, remaining;
 #ifdef _USE_KNETFILE
-    int64_t block_address = knet_tell(fp->x.fpr);
-	if (load_block_from_cache(fp, block_address)) return 0;
-    count = knet_read(fp->x.fpr, header, sizeof(header));
+	return knet_tell(fp->x.fpr);
 #else
-    int64_t block_address = ftello(fp->file);
-	if (load_block_from_cache(fp, block_address)) return 0;
-    count = fread(header, 1, sizeof(header), fp->file);
+	return ftello(fp->file);
 #endif
-    if (count == 0) {
-        fp->block_length = 0;
-        return 0;
-    }
-	size = count;
-    if (count != sizeof(header)) {
-        report_error(fp, "read failed");
+}
+
+static inline int raw_read(BGZF *fp, void *buf, int length)
+{
+#ifdef _USE_KNETFILE
+	return knet_read(fp->x.fpr, buf, length);
+#else
+	return fread(buf, 1, length, fp->file);
+#endif
+}
+
+// Read the next compressed block into buffer; returns its size on disk, 0 at the end of file or -1 with *error set
+static
+int
+read_compressed_block(BGZF* fp, bgzf_byte_t* buffer, int* block_length, const char** error)
+{
+	int count, remaining;
+    count = raw_read(fp, buffer, BLOCK_HEADER_LENGTH);
+    if (count == 0) return 0;
+    if (count != BLOCK_HEADER_LENGTH) {
+        *error = "read failed";
         return -1;
     }
-    if (!check_header(header)) {
-        report_error(fp, "invalid block header");
+    if (!check_header(buffer)) {
+        *error = "invalid block header";
         return -1;
     }
-    block_length = unpackInt16((uint8_t*)&header[16]) + 1;
-    bgzf_byte_t* compressed_block = (bgzf_byte_t*) fp->compressed_block;
-    memcpy(compressed_block, header, BLOCK_HEADER_LENGTH);
-    remaining = block_length - BLOCK_HEADER_LENGTH;
-#ifdef _USE_KNETFILE
-    count = knet_read(fp->x.fpr, &compressed_block[BLOCK_HEADER_LENGTH], remaining);
-#else
-    count = fread(&compressed_block[BLOCK_HEADER_LENGTH], 1, remaining, fp->file);
-#endif
+    *block_length = unpackInt16((uint8_t*)&buffer[16]) + 1;
+    remaining = *block_length - BLOCK_HEADER_LENGTH;
+    count = raw_read(fp, &buffer[BLOCK_HEADER_LENGTH], remaining);
     if (count != remaining) {
-        report_error(fp, "read failed");
+        *error = "read failed";
         return -1;
     }
-	size += count;
+	return *block_length;
+}
+
+static int mt_read_block(BGZF *fp);
+
+int
+bgzf_read_block(BGZF* fp)
+{
+	int count, size, block_length = 0;
+	const char *error = NULL;
+	if (fp->mt) return mt_read_block(fp);
+    int64_t block_address = raw_tell(fp);
+	if (load_block_from_cache(fp, block_address)) return 0;
+	size = read_compressed_block(fp, fp->compressed_block, &block_length, &error);
+    if (size == 0) {
+        fp->block_length = 0;
+        return 0;
+    }
+	if (size < 0) {
+		report_error(fp, error);
+		return -1;
+	}
     count = inflate_block(fp, block_length);
     if (count < 0) return -1;
     if (fp->block_length != 0) {
@@ -553,19 +608,428 @@ bgzf_read(BGZF* fp, void* data, int length)
         bytes_read += copy_length;
     }
     if (fp->block_offset == fp->block_length) {
-#ifdef _USE_KNETFILE
-        fp->block_address = knet_tell(fp->x.fpr);
-#else
-        fp->block_address = ftello(fp->file);
-#endif
+        fp->block_address = bgzf_next_block_address(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
     return bytes_read;
 }
 
+/* Read-ahead pipeline. Blocks go through a ring of slots in file order: the reader thread fills the slot of block
+   n_read once the consumer has taken block n_read - n_slots, the workers inflate blocks in the order they were read,
+   and bgzf_read_block takes block n_taken as soon as it is inflated. Only the reader touches the file. */
+
+enum { MT_LOADED, MT_BUSY, MT_READY, MT_FAILED };
+
+typedef struct {
+	int state, block_length, size; // block_length, inflated length; size, compressed size on disk
+	int64_t address;
+	bgzf_byte_t *compressed;
+	void *uncompressed;
+	const char *error;
+} mt_slot_t;
+
+typedef struct {
+	BGZF *fp;
+	int n_threads, n_slots;
+	mt_slot_t *slots;
+	int64_t n_read, n_claimed, n_taken; // blocks read by the reader, claimed by workers and taken by the consumer
+	int done_reading, stop;
+	int64_t next_address; // address of the block after the one being consumed
+	pthread_mutex_t lock;
+	pthread_cond_t cond_reader, cond_worker, cond_consumer;
+	pthread_t reader, *workers;
+} mt_reader_t;
+
+static void *mt_reader_func(void *data)
+{
+	mt_reader_t *mt = (mt_reader_t*)data;
+	mt_slot_t *slot;
+	int64_t address;
+	int size, block_length = 0;
+	const char *error = NULL;
+
+	while (1) {
+		pthread_mutex_lock(&mt->lock);
+		while (!mt->stop && mt->n_read - mt->n_taken >= mt->n_slots) pthread_cond_wait(&mt->cond_reader, &mt->lock);
+		if (mt->stop) { pthread_mutex_unlock(&mt->lock); break; }
+		slot = &mt->slots[mt->n_read % mt->n_slots];
+		pthread_mutex_unlock(&mt->lock);
+
+		address = raw_tell(mt->fp);
+		size = read_compressed_block(mt->fp, slot->compressed, &block_length, &error);
+
+		pthread_mutex_lock(&mt->lock);
+		if (size != 0) {
+			slot->address = address;
+			slot->size = size;
+			slot->block_length = block_length;
+			slot->state = size > 0? MT_LOADED : MT_FAILED;
+			slot->error = error;
+			++mt->n_read;
+		}
+		if (size <= 0) mt->done_reading = 1;
+		pthread_cond_broadcast(&mt->cond_worker);
+		pthread_cond_broadcast(&mt->cond_consumer);
+		pthread_mutex_unlock(&mt->lock);
+		if (size <= 0) break;
+	}
+	return 0;
+}
+
+static void *mt_worker_func(void *data)
+{
+	mt_reader_t *mt = (mt_reader_t*)data;
+	mt_slot_t *slot;
+	int count;
+	const char *error = NULL;
+
+	while (1) {
+		pthread_mutex_lock(&mt->lock);
+		while (!mt->stop && mt->n_claimed == mt->n_read && !mt->done_reading) pthread_cond_wait(&mt->cond_worker, &mt->lock);
+		if (mt->stop || mt->n_claimed == mt->n_read) { pthread_mutex_unlock(&mt->lock); break; }
+		slot = &mt->slots[mt->n_claimed++ % mt->n_slots];
+		if (slot->state != MT_LOADED) { pthread_mutex_unlock(&mt->lock); continue; } // a read error, left for the consumer
+		slot->state = MT_BUSY;
+		pthread_mutex_unlock(&mt->lock);
+
+		count = inflate_data(slot->compressed, slot->block_length, slot->uncompressed, MAX_BLOCK_SIZE, &error);
+
+		pthread_mutex_lock(&mt->lock);
+		if (count >= 0) { slot->block_length = count; slot->state = MT_READY; }
+		else { slot->error = error; slot->state = MT_FAILED; }
+		pthread_cond_broadcast(&mt->cond_consumer);
+		pthread_mutex_unlock(&mt->lock);
+	}
+	return 0;
+}
+
+static int mt_read_block(BGZF *fp)
+{
+	mt_reader_t *mt = (mt_reader_t*)fp->mt;
+	mt_slot_t *slot;
+	void *tmp;
+
+	pthread_mutex_lock(&mt->lock);
+	while (1) {
+		if (mt->n_taken < mt->n_read) {
+			slot = &mt->slots[mt->n_taken % mt->n_slots];
+			if (slot->state == MT_READY || slot->state == MT_FAILED) break;
+		}
+		else if (mt->done_reading) { // end of file
+			pthread_mutex_unlock(&mt->lock);
+			fp->block_length = 0;
+			return 0;
+		}
+		pthread_cond_wait(&mt->cond_consumer, &mt->lock);
+	}
+	if (slot->state == MT_FAILED) {
+		pthread_mutex_unlock(&mt->lock);
+		report_error(fp, slot->error);
+		return -1;
+	}
+
+	// hand the inflated buffer over instead of copying it
+	tmp = fp->uncompressed_block; fp->uncompressed_block = slot->uncompressed; slot->uncompressed = tmp;
+	if (fp->block_length != 0) fp->block_offset = 0; // do not reset offset if this read follows a seek
+	fp->block_address = slot->address;
+	fp->block_length = slot->block_length;
+	mt->next_address = slot->address + slot->size;
+	++mt->n_taken;
+	pthread_cond_signal(&mt->cond_reader);
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+static int mt_num_threads(BGZF *fp)
+{
+	return ((mt_reader_t*)fp->mt)->n_threads;
+}
+
+// stop the reader thread, if it was started, and the first n_threads workers, then free mt
+static void mt_free(mt_reader_t *mt, int has_reader)
+{
+	BGZF *fp = mt->fp;
+	int i;
+
+	pthread_mutex_lock(&mt->lock);
+	mt->stop = 1;
+	pthread_cond_broadcast(&mt->cond_reader);
+	pthread_cond_broadcast(&mt->cond_worker);
+	pthread_mutex_unlock(&mt->lock);
+	if (has_reader) pthread_join(mt->reader, 0);
+	for (i = 0; i < mt->n_threads; ++i) pthread_join(mt->workers[i], 0);
+
+	// the file was read ahead, move it back to the end of the block being consumed
+#ifdef _USE_KNETFILE
+	knet_seek(fp->x.fpr, mt->next_address, SEEK_SET);
+#else
+	fseeko(fp->file, mt->next_address, SEEK_SET);
+#endif
+
+	for (i = 0; i < mt->n_slots; ++i) {
+		free(mt->slots[i].compressed);
+		free(mt->slots[i].uncompressed);
+	}
+	free(mt->slots);
+	free(mt->workers);
+	pthread_mutex_destroy(&mt->lock);
+	pthread_cond_destroy(&mt->cond_reader);
+	pthread_cond_destroy(&mt->cond_worker);
+	pthread_cond_destroy(&mt->cond_consumer);
+	free(mt);
+}
+
+static void mt_destroy(BGZF *fp)
+{
+	mt_free((mt_reader_t*)fp->mt, 1);
+	fp->mt = 0;
+}
+
+int bgzf_set_read_threads(BGZF *fp, int n_threads)
+{
+	mt_reader_t *mt;
+	int i;
+
+	if (fp->open_mode != 'r' || fp->mt || n_threads < 1) return -1;
+
+	mt = (mt_reader_t*)calloc(1, sizeof(mt_reader_t));
+	mt->fp = fp;
+	mt->n_slots = 4 * n_threads + 4;
+	mt->slots = (mt_slot_t*)calloc(mt->n_slots, sizeof(mt_slot_t));
+	for (i = 0; i < mt->n_slots; ++i) {
+		mt->slots[i].compressed = (bgzf_byte_t*)malloc(MAX_BLOCK_SIZE);
+		mt->slots[i].uncompressed = malloc(MAX_BLOCK_SIZE);
+	}
+	mt->next_address = raw_tell(fp);
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->cond_reader, 0);
+	pthread_cond_init(&mt->cond_worker, 0);
+	pthread_cond_init(&mt->cond_consumer, 0);
+	mt->workers = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+	// fp->mt is only set once every thread runs, so a failure leaves fp reading on the calling thread
+	if (pthread_create(&mt->reader, 0, mt_reader_func, mt) != 0) {
+		report_error(fp, "cannot create the reader thread");
+		mt_free(mt, 0);
+		return -1;
+	}
+	for (; mt->n_threads < n_threads; ++mt->n_threads)
+		if (pthread_create(&mt->workers[mt->n_threads], 0, mt_worker_func, mt) != 0) {
+			report_error(fp, "cannot create inflating threads");
+			mt_free(mt, 1);
+			return -1;
+		}
+	fp->mt = mt;
+	return 0;
+}
+
+int64_t bgzf_next_block_address(BGZF *fp)
+{
+	return fp->mt? ((mt_reader_t*)fp->mt)->next_address : raw_tell(fp);
+}
+
+/* Write pipeline. bgzf_flush hands the filled block over to slot n_filled % n_slots, workers deflate blocks in the
+   order they were handed over, each with its own deflate stream, and the calling thread writes them out in order
+   whenever it needs a free slot or the file is closed. Only the calling thread touches the file. */
+
+typedef struct {
+	BGZF *fp;
+	int n_threads, n_slots, level;
+	mt_slot_t *slots;
+	int64_t n_filled, n_claimed, n_written; // blocks handed over, claimed by workers and written to the file
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond_worker, cond_writer;
+	pthread_t *workers;
+} mt_writer_t;
+
+// deflate a slot into one block, or two if the input does not compress enough
+static int mt_deflate_slot(z_stream *zs, int level, mt_slot_t *slot, const char **error)
+{
+	const bgzf_byte_t *input = slot->uncompressed;
+	int remaining = slot->block_length, size = 0, count, input_length;
+
+	while (remaining > 0) {
+		if (size > MAX_BLOCK_SIZE) {
+			// should never happen
+			*error = "remainder too large";
+			return -1;
+		}
+		count = deflate_data(zs, level, input, remaining, slot->compressed + size, MAX_BLOCK_SIZE, &input_length, error);
+		if (count < 0) return -1;
+		size += count;
+		input += input_length;
+		remaining -= input_length;
+	}
+	return size;
+}
+
+static void *mt_deflate_func(void *data)
+{
+	mt_writer_t *mt = (mt_writer_t*)data;
+	mt_slot_t *slot;
+	z_stream zs;
+	int size, ok;
+	const char *error = "deflate init failed";
+
+	zs.zalloc = NULL;
+	zs.zfree = NULL;
+	zs.opaque = NULL;
+	ok = deflateInit2(&zs, mt->level, Z_DEFLATED, GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+
+	while (1) {
+		pthread_mutex_lock(&mt->lock);
+		while (!mt->stop && mt->n_claimed == mt->n_filled) pthread_cond_wait(&mt->cond_worker, &mt->lock);
+		if (mt->n_claimed == mt->n_filled) { pthread_mutex_unlock(&mt->lock); break; }
+		slot = &mt->slots[mt->n_claimed++ % mt->n_slots];
+		slot->state = MT_BUSY;
+		pthread_mutex_unlock(&mt->lock);
+
+		size = ok? mt_deflate_slot(&zs, mt->level, slot, &error) : -1;
+
+		pthread_mutex_lock(&mt->lock);
+		if (size >= 0) { slot->size = size; slot->state = MT_READY; }
+		else { slot->error = error; slot->state = MT_FAILED; }
+		pthread_cond_broadcast(&mt->cond_writer);
+		pthread_mutex_unlock(&mt->lock);
+	}
+	if (ok) deflateEnd(&zs);
+	return 0;
+}
+
+// write deflated blocks in order, waiting for them until block upto - 1 is written
+static int mt_write_deflated(BGZF *fp, int64_t upto)
+{
+	mt_writer_t *mt = (mt_writer_t*)fp->mt;
+	mt_slot_t *slot;
+	int state, count;
+
+	pthread_mutex_lock(&mt->lock);
+	while (mt->n_written < mt->n_filled) {
+		slot = &mt->slots[mt->n_written % mt->n_slots];
+		state = slot->state;
+		if (state != MT_READY && state != MT_FAILED) {
+			if (mt->n_written >= upto) break;
+			pthread_cond_wait(&mt->cond_writer, &mt->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&mt->lock);
+		if (state == MT_FAILED) {
+			report_error(fp, slot->error);
+			return -1;
+		}
+#ifdef _USE_KNETFILE
+		count = fwrite(slot->compressed, 1, slot->size, fp->x.fpw);
+#else
+		count = fwrite(slot->compressed, 1, slot->size, fp->file);
+#endif
+		if (count != slot->size) {
+			report_error(fp, "write failed");
+			return -1;
+		}
+		fp->block_address += slot->size;
+		pthread_mutex_lock(&mt->lock);
+		++mt->n_written;
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+static int mt_write_block(BGZF *fp)
+{
+	mt_writer_t *mt = (mt_writer_t*)fp->mt;
+	mt_slot_t *slot;
+	void *tmp;
+
+	// the slot is free once the block that used it before is written
+	if (mt_write_deflated(fp, mt->n_filled - mt->n_slots + 1) != 0) return -1;
+	slot = &mt->slots[mt->n_filled % mt->n_slots];
+
+	// hand the filled buffer over instead of copying it
+	tmp = fp->uncompressed_block; fp->uncompressed_block = slot->uncompressed; slot->uncompressed = tmp;
+	slot->block_length = fp->block_offset;
+	slot->state = MT_LOADED;
+	fp->block_offset = 0;
+
+	pthread_mutex_lock(&mt->lock);
+	++mt->n_filled;
+	pthread_cond_signal(&mt->cond_worker);
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+// stop the first n_threads workers and free mt
+static void mt_writer_free(mt_writer_t *mt)
+{
+	int i;
+
+	pthread_mutex_lock(&mt->lock);
+	mt->stop = 1;
+	pthread_cond_broadcast(&mt->cond_worker);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 0; i < mt->n_threads; ++i) pthread_join(mt->workers[i], 0);
+
+	for (i = 0; i < mt->n_slots; ++i) {
+		free(mt->slots[i].compressed);
+		free(mt->slots[i].uncompressed);
+	}
+	free(mt->slots);
+	free(mt->workers);
+	pthread_mutex_destroy(&mt->lock);
+	pthread_cond_destroy(&mt->cond_worker);
+	pthread_cond_destroy(&mt->cond_writer);
+	free(mt);
+}
+
+static void mt_writer_destroy(BGZF *fp)
+{
+	mt_writer_free((mt_writer_t*)fp->mt);
+	fp->mt = 0;
+}
+
+int bgzf_set_write_threads(BGZF *fp, int n_threads)
+{
+	mt_writer_t *mt;
+	int i;
+
+	if (fp->open_mode != 'w' || fp->mt || n_threads < 1) return -1;
+
+	mt = (mt_writer_t*)calloc(1, sizeof(mt_writer_t));
+	mt->fp = fp;
+	mt->n_slots = 4 * n_threads + 4;
+	mt->level = fp->compress_level;
+	mt->slots = (mt_slot_t*)calloc(mt->n_slots, sizeof(mt_slot_t));
+	for (i = 0; i < mt->n_slots; ++i) {
+		mt->slots[i].compressed = (bgzf_byte_t*)malloc(2 * MAX_BLOCK_SIZE);
+		mt->slots[i].uncompressed = malloc(fp->uncompressed_block_size);
+	}
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->cond_worker, 0);
+	pthread_cond_init(&mt->cond_writer, 0);
+	mt->workers = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+	// fp->mt is only set once every thread runs, so a failure leaves fp deflating on the calling thread
+	for (; mt->n_threads < n_threads; ++mt->n_threads)
+		if (pthread_create(&mt->workers[mt->n_threads], 0, mt_deflate_func, mt) != 0) {
+			report_error(fp, "cannot create deflating threads");
+			mt_writer_free(mt);
+			return -1;
+		}
+	fp->mt = mt;
+	return 0;
+}
+
+int64_t bgzf_tell(BGZF *fp)
+{
+	// block_address only counts the blocks written out, so write out the ones still with the deflating threads
+	if (fp->mt && fp->open_mode == 'w' && mt_write_deflated(fp, ((mt_writer_t*)fp->mt)->n_filled) != 0) return -1;
+	return (fp->block_address << 16) | (fp->block_offset & 0xFFFF);
+}
+
 int bgzf_flush(BGZF* fp)
 {
+	if (fp->mt) return fp->block_offset > 0? mt_write_block(fp) : 0;
     while (fp->block_offset > 0) {
         int count, block_length;
 		block_length = deflate_block(fp, fp->block_offset);
@@ -624,8 +1088,13 @@ int bgzf_write(BGZF* fp, const void* data, int length)
 
 int bgzf_close(BGZF* fp)
 {
+	if (fp->mt && fp->open_mode == 'r') mt_destroy(fp);
     if (fp->open_mode == 'w') {
         if (bgzf_flush(fp) != 0) return -1;
+		if (fp->mt) {
+			if (mt_write_deflated(fp, ((mt_writer_t*)fp->mt)->n_filled) != 0) return -1;
+			mt_writer_destroy(fp);
+		}
 		{ // add an empty block
 			int count, block_length = deflate_block(fp, 0);
 #ifdef _USE_KNETFILE
@@ -686,7 +1155,7 @@ int bgzf_check_EOF(BGZF *fp)
 
 int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
 {
-	int block_offset;
+	int block_offset, n_threads = 0;
 	int64_t block_address;
 
     if (fp->open_mode != 'r') {
@@ -699,6 +1168,10 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
     }
     block_offset = pos & 0xFFFF;
     block_address = (pos >> 16) & 0xFFFFFFFFFFFFLL;
+	if (fp->mt) { // restart reading ahead from the new position
+		n_threads = mt_num_threads(fp);
+		mt_destroy(fp);
+	}
 #ifdef _USE_KNETFILE
     if (knet_seek(fp->x.fpr, block_address, SEEK_SET) != 0) {
 #else
@@ -710,5 +1183,6 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
     fp->block_length = 0;  // indicates current block is not loaded
     fp->block_address = block_address;
     fp->block_offset = block_offset;
+	if (n_threads > 0) bgzf_set_read_threads(fp, n_threads); // on failure, fp reads on the calling thread
     return 0;
 }
@@ -55,6 +55,7 @@ typedef struct {
 	int cache_size;
     const char* error;
 	void *cache; // a pointer to a hash table
+	void *mt; // read-ahead or deflating pipeline, NULL if working on the calling thread
 } BGZF;
 
 #ifdef __cplusplus
@@ -104,8 +105,9 @@ int bgzf_write(BGZF* fp, const void* data, int length);
  * call to bgzf_seek can be used to position the file at the same point.
  * Return value is non-negative on success.
  * Returns -1 on error.
+ * With deflating threads, the blocks they hold are written out first.
  */
-#define bgzf_tell(fp) ((fp->block_address << 16) | (fp->block_offset & 0xFFFF))
+int64_t bgzf_tell(BGZF *fp);
 
 /*
  * Set the file to read from the location specified by pos, which must
@@ -124,6 +126,30 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where);
  */
 void bgzf_set_cache_size(BGZF *fp, int cache_size);
 
+/*
+ * Read ahead with one thread fetching compressed blocks and n_threads
+ * threads inflating them, blocks are still returned in file order.
+ * Only for files opened for reading, the block cache is bypassed.
+ * Returns zero on success, -1 on error, in which case fp keeps
+ * reading on the calling thread.
+ */
+int bgzf_set_read_threads(BGZF *fp, int n_threads);
+
+/*
+ * Address of the block following the current one. With read-ahead,
+ * the underlying file is already positioned further.
+ */
+int64_t bgzf_next_block_address(BGZF *fp);
+
+/*
+ * Deflate blocks with n_threads threads, blocks are still written in
+ * order. Only for files opened for writing. bgzf_flush then hands the
+ * block over without waiting for it, bgzf_close writes out the rest.
+ * Returns zero on success, -1 on error, in which case fp keeps
+ * deflating on the calling thread.
+ */
+int bgzf_set_write_threads(BGZF *fp, int n_threads);
+
 int bgzf_check_EOF(BGZF *fp);
 int bgzf_read_block(BGZF* fp);
 int bgzf_flush(BGZF* fp);
@@ -143,11 +169,7 @@ static inline int bgzf_getc(BGZF *fp)
 	}
 	c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-#ifdef _USE_KNETFILE
-        fp->block_address = knet_tell(fp->x.fpr);
-#else
-        fp->block_address = ftello(fp->file);
-#endif
+        fp->block_address = bgzf_next_block_address(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -115,10 +115,10 @@ open_err_ret:
 void samclose(samfile_t *fp)
 {
 	if (fp == 0) return;
-	if (fp->header) bam_header_destroy(fp->header);
 	if (fp->type & TYPE_BAM) bam_close(fp->x.bam);
-	else if (fp->type & TYPE_READ) sam_close(fp->x.tamr);
+	else if (fp->type & TYPE_READ) sam_close(fp->x.tamr); // before the header, which parsing threads may still use
 	else fclose(fp->x.tamw);
+	if (fp->header) bam_header_destroy(fp->header);
 	free(fp);
 }
 
@@ -2,10 +2,23 @@
 #define UTILS_H_
 
 #include<stdint.h>
+#include<inttypes.h>
 
-// change to uint64_t if too many data are there
+// csem64 is built with -DCSEM64 for inputs with more records than 32-bit indices can count
+#ifdef CSEM64
+typedef uint64_t HIT_INT_TYPE;
+typedef uint64_t READ_INT_TYPE;
+#else
 typedef uint32_t HIT_INT_TYPE;
 typedef uint32_t READ_INT_TYPE;
+#endif
+// csem-float is built with -DCSEM_FLOAT and keeps the EM state (fractions, window sums) in single precision
+#ifdef CSEM_FLOAT
+typedef float FRAC_TYPE;
+#else
+typedef double FRAC_TYPE;
+#endif
+
 typedef int32_t CHR_ID_TYPE;
 typedef int32_t CHR_LEN_TYPE; // must be signed type , the coordinates can be negative for some cases
 
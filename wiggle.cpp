@@ -64,17 +64,18 @@ void add_bam_record_to_wiggle(const bam1_t *b, Wiggle& wiggle) {
 }
 
 void build_wiggles(const std::string& bam_filename,
-                   WiggleProcessor& processor) {
+                   WiggleProcessor& processor, int nThreads) {
 
 	samfile_t *bam_in = samopen(bam_filename.c_str(), "rb", NULL);
 	if (bam_in == 0) { fprintf(stderr, "Cannot open %s!\n", bam_filename.c_str()); exit(-1); }
+	if (nThreads > 1 && bgzf_set_read_threads(bam_in->x.bam, nThreads) != 0) fprintf(stderr, "Cannot start threads for reading %s, reading it on one thread!\n", bam_filename.c_str());
 
 	bam_header_t *header = bam_in->header;
 	bool *used = new bool[header->n_targets];
 	memset(used, 0, sizeof(bool) * header->n_targets);
 
 	int cur_tid = -1; //current tid;
-	HIT_INT_TYPE cnt = 0;
+	uint64_t cnt = 0;
 	bam1_t *b = bam_init1();
 	Wiggle wiggle;
 	while (samread(bam_in, b) >= 0) {
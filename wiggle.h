@@ -36,7 +36,8 @@ private:
     FILE *fo;
 };
 
+// nThreads > 1 inflates the BAM file on nThreads background threads
 void build_wiggles(const std::string& bam_filename,
-                   WiggleProcessor& processor);
+                   WiggleProcessor& processor, int nThreads = 1);
 
 #endif